@@ -0,0 +1,312 @@
+#include "BufferQueue.h"
+#include "TileCompare.h"
+#include "FormatConvert.h"
+
+#include <OS.h>
+
+#include <private/shared/AutoDeleter.h>
+#include <private/shared/PthreadMutexLocker.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include <thread>
+#include <vector>
+
+
+// Microbenchmarks of the host side of presenting, no Vulkan device is needed.
+// Run directly or with "meson test --benchmark".
+
+static constexpr uint32_t kWidth = 1920;
+static constexpr uint32_t kHeight = 1080;
+static constexpr bigtime_t kRunTime = 250000;
+
+// Keeps results alive, so the measured calls are not optimized out.
+static volatile uint32_t sSink;
+
+// Calls func until kRunTime passed, returns the calls per second.
+template<typename Func>
+static double measure(Func func)
+{
+	func();
+	uint32_t calls = 0;
+	bigtime_t start = system_time();
+	bigtime_t elapsed;
+	do {
+		func();
+		calls++;
+		elapsed = system_time() - start;
+	} while (elapsed < kRunTime);
+	return calls * 1000000.0 / elapsed;
+}
+
+// Bandwidth is only shown for calls that touch all of their bytes.
+static void report(const char *name, double rate, double bytes = 0)
+{
+	if (bytes > 0)
+		printf("%-44s %10.1f/s %10.1f MB/s\n", name, rate, rate * bytes / (1024 * 1024));
+	else
+		printf("%-44s %10.1f/s\n", name, rate);
+}
+
+
+//#pragma mark - RowsDiffer
+
+// Damage detection compares B_RGB32 frames in 64x64 pixel tiles.
+static void benchRowsDiffer()
+{
+	constexpr uint32_t kTileSize = 64;
+	size_t stride = kWidth * 4;
+	std::vector<uint8_t> a(stride * kHeight, 0x55);
+	std::vector<uint8_t> b = a;
+
+	auto compareTiles = [&]() {
+		uint32_t differing = 0;
+		for (uint32_t top = 0; top < kHeight; top += kTileSize) {
+			uint32_t rows = std::min(kTileSize, kHeight - top);
+			for (uint32_t left = 0; left < kWidth; left += kTileSize) {
+				size_t offset = top * stride + left * 4;
+				size_t rowBytes = std::min(kTileSize, kWidth - left) * 4;
+				differing += RowsDiffer(a.data() + offset, stride, b.data() + offset, stride, rowBytes, rows);
+			}
+		}
+		sSink = differing;
+	};
+
+	// Unchanged frames are the worst case, every byte is read.
+	report("RowsDiffer, equal frame", measure(compareTiles), 2.0 * stride * kHeight);
+
+	// A change in the first row of every tile ends each comparison early.
+	for (uint32_t top = 0; top < kHeight; top += kTileSize)
+		memset(b.data() + top * stride, 0xaa, stride);
+	report("RowsDiffer, changed frame", measure(compareTiles));
+}
+
+
+//#pragma mark - FormatConvert
+
+// Formats converted to B_RGB32 by the present thread, a whole frame at a time.
+static void benchFormatConvert()
+{
+	static const struct {
+		VkFormat format;
+		const char *name;
+	} kFormats[] = {
+		{VK_FORMAT_R8G8B8A8_UNORM, "R8G8B8A8_UNORM"},
+		{VK_FORMAT_A2B10G10R10_UNORM_PACK32, "A2B10G10R10_UNORM_PACK32"},
+		{VK_FORMAT_A2R10G10B10_UNORM_PACK32, "A2R10G10B10_UNORM_PACK32"},
+		{VK_FORMAT_R16G16B16A16_UNORM, "R16G16B16A16_UNORM"},
+		{VK_FORMAT_R16G16B16A16_SFLOAT, "R16G16B16A16_SFLOAT"},
+	};
+
+	std::vector<uint32_t> dst(kWidth * kHeight);
+	for (const auto &item: kFormats) {
+		FormatConversion conversion;
+		if (!FindRgb32Conversion(item.format, conversion))
+			continue;
+		// 0x3c3c is a half float just above 1, the other formats take any bits.
+		size_t srcStride = kWidth * conversion.srcPixelSize;
+		std::vector<uint8_t> src(srcStride * kHeight, 0x3c);
+
+		double rate = measure([&]() {
+			for (uint32_t y = 0; y < kHeight; y++)
+				conversion.convertRow(dst.data() + y * kWidth, src.data() + y * srcStride, kWidth);
+			sSink = dst[0];
+		});
+		char name[64];
+		snprintf(name, sizeof(name), "convert %s", item.name);
+		report(name, rate, (double)srcStride * kHeight);
+	}
+}
+
+
+//#pragma mark - Row pitch
+
+// Frames the bitmap can not share are copied into it by the present thread.
+// Readback buffers and their bitmaps have rows aligned to cache lines, so a
+// full width damage is one memcpy. Linear images have the row pitch the
+// driver picks and are copied row by row. 1366 pixel rows are no multiple
+// of a cache line.
+static void benchRowPitch()
+{
+	constexpr uint32_t kOddWidth = 1366;
+	constexpr size_t kRowAlignment = 64;
+	size_t rowSize = kOddWidth * 4;
+	size_t alignedPitch = (rowSize + kRowAlignment - 1) / kRowAlignment * kRowAlignment;
+
+	std::vector<uint8_t> src(alignedPitch * kHeight + kRowAlignment, 0x55);
+	std::vector<uint8_t> dst(alignedPitch * kHeight + kRowAlignment);
+	// Vectors are only aligned for their element type.
+	uint8_t *srcBits = src.data() + (kRowAlignment - (uintptr_t)src.data() % kRowAlignment) % kRowAlignment;
+	uint8_t *dstBits = dst.data() + (kRowAlignment - (uintptr_t)dst.data() % kRowAlignment) % kRowAlignment;
+
+	double rate = measure([&]() {
+		for (uint32_t y = 0; y < kHeight; y++)
+			memcpy(dstBits + y * rowSize, srcBits + y * rowSize, rowSize);
+		sSink = dstBits[0];
+	});
+	report("copy 1366 wide, packed rows", rate, (double)rowSize * kHeight);
+
+	rate = measure([&]() {
+		memcpy(dstBits, srcBits, alignedPitch * kHeight);
+		sSink = dstBits[0];
+	});
+	report("copy 1366 wide, cache line aligned rows", rate, (double)rowSize * kHeight);
+}
+
+
+//#pragma mark - BufferQueue
+
+// Baseline: the queue BufferQueue replaced, every call takes the mutex.
+class MutexQueue {
+private:
+	ArrayDeleter<int32> fItems;
+	int32 fBeg, fLen, fMaxLen;
+	pthread_mutex_t fLock;
+	pthread_cond_t fEmptyCv;
+
+public:
+	MutexQueue():
+		fItems(NULL),
+		fBeg(0), fLen(0), fMaxLen(0),
+		fLock(PTHREAD_MUTEX_INITIALIZER),
+		fEmptyCv(PTHREAD_COND_INITIALIZER)
+	{}
+
+	bool SetMaxLen(int32 maxLen, bool multiProducer = false)
+	{
+		(void)multiProducer;
+		auto newItems = new(std::nothrow) int32[maxLen];
+		if (newItems == NULL)
+			return false;
+		fItems.SetTo(newItems);
+		fBeg = 0; fLen = 0; fMaxLen = maxLen;
+		return true;
+	}
+
+	bool Add(int32 val)
+	{
+		PthreadMutexLocker lock(&fLock);
+		if (!(fLen < fMaxLen))
+			return false;
+		fItems[(fBeg + fLen)%fMaxLen] = val;
+		if (fLen == 0) pthread_cond_signal(&fEmptyCv);
+		fLen++;
+		return true;
+	}
+
+	int32 Remove()
+	{
+		PthreadMutexLocker lock(&fLock);
+		while (!(fLen > 0)) pthread_cond_wait(&fEmptyCv, &fLock);
+		int32 res = fItems[fBeg];
+		fBeg = (fBeg + 1)%fMaxLen;
+		fLen--;
+		return res;
+	}
+
+	bool TryRemove(int32 &val)
+	{
+		PthreadMutexLocker lock(&fLock);
+		if (!(fLen > 0))
+			return false;
+		val = fItems[fBeg];
+		fBeg = (fBeg + 1)%fMaxLen;
+		fLen--;
+		return true;
+	}
+};
+
+// Image indices circle between an acquiring thread and a presenting thread,
+// like between the application and a swapchain's present thread.
+template<typename Queue>
+static void benchQueue(const char *queueName)
+{
+	constexpr int32 kImageCnt = 3;
+	constexpr int32 kRoundTrips = 100000;
+	char name[64];
+
+	Queue pool, presents;
+	if (!pool.SetMaxLen(kImageCnt) || !presents.SetMaxLen(kImageCnt))
+		return;
+
+	double rate = measure([&]() {
+		for (int32 i = 0; i < kImageCnt; i++)
+			pool.Add(i);
+		std::thread presentThread([&]() {
+			for (int32 i = 0; i < kRoundTrips; i++)
+				pool.Add(presents.Remove());
+		});
+		for (int32 i = 0; i < kRoundTrips; i++)
+			presents.Add(pool.Remove());
+		presentThread.join();
+		int32 imageIdx;
+		while (pool.TryRemove(imageIdx)) {}
+	});
+	snprintf(name, sizeof(name), "%s, round trips", queueName);
+	report(name, rate * kRoundTrips);
+
+	// Readback buffers are also returned by the present threads of other
+	// swapchains on the surface, two producers share the pool.
+	Queue sharedPool;
+	if (!sharedPool.SetMaxLen(2 * kImageCnt, true))
+		return;
+	rate = measure([&]() {
+		for (int32 i = 0; i < kImageCnt; i++)
+			presents.Add(i);
+		std::thread presentThread([&]() {
+			for (int32 i = 0; i < kRoundTrips; i++) {
+				int32 imageIdx = presents.Remove();
+				while (!sharedPool.Add(imageIdx))
+					std::this_thread::yield();
+			}
+		});
+		std::thread otherThread([&]() {
+			for (int32 i = 0; i < kRoundTrips; i++) {
+				while (!sharedPool.Add(kImageCnt))
+					std::this_thread::yield();
+			}
+		});
+		for (int32 i = 0; i < 2 * kRoundTrips; i++) {
+			int32 imageIdx = sharedPool.Remove();
+			if (imageIdx < kImageCnt)
+				presents.Add(imageIdx);
+		}
+		presentThread.join();
+		otherThread.join();
+		int32 imageIdx;
+		while (presents.TryRemove(imageIdx)) {}
+	});
+	snprintf(name, sizeof(name), "%s, two producers", queueName);
+	report(name, rate * 2 * kRoundTrips);
+
+	// Without a waiting consumer BufferQueue takes no lock at either end.
+	rate = measure([&]() {
+		int32 imageIdx = 0;
+		for (int32 i = 0; i < kRoundTrips; i++) {
+			pool.Add(imageIdx);
+			pool.TryRemove(imageIdx);
+		}
+		sSink = imageIdx;
+	});
+	snprintf(name, sizeof(name), "%s, uncontended add/remove", queueName);
+	report(name, rate * kRoundTrips);
+}
+
+static void benchBufferQueue()
+{
+	benchQueue<BufferQueue>("BufferQueue");
+	benchQueue<MutexQueue>("mutex queue");
+}
+
+
+int main()
+{
+	printf("%ux%u frames\n", kWidth, kHeight);
+	benchRowsDiffer();
+	benchFormatConvert();
+	benchRowPitch();
+	benchBufferQueue();
+	return 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <SupportDefs.h>
+
+
+class BBitmap;
+class BRegion;
+
+// Interface between the layer and the consumer of a headless surface. The
+// VkSurfaceKHR handle of the surface points to a VKLayerSurfaceBase.
+
+enum {
+	// The hook implements UpdateBitmap().
+	BITMAP_HOOK_DAMAGE = 1 << 0,
+};
+
+class BitmapHook {
+public:
+	virtual ~BitmapHook() {};
+	virtual void GetSize(uint32_t &width, uint32_t &height) = 0;
+	virtual BBitmap *SetBitmap(BBitmap *bmp) = 0;
+	// Like SetBitmap(), but only pixels inside dirty differ from the previous
+	// bitmap. Called for hooks registered with BITMAP_HOOK_DAMAGE only, hooks
+	// built against older headers lack this vtable slot.
+	virtual BBitmap *UpdateBitmap(BBitmap *bmp, const BRegion &dirty) {(void)dirty; return SetBitmap(bmp);}
+};
+
+class VKLayerSurfaceBase {
+public:
+	virtual ~VKLayerSurfaceBase() {};
+	virtual void SetBitmapHook(BitmapHook *hook) = 0;
+	virtual void SetBitmapHookEtc(BitmapHook *hook, uint32 flags) = 0;
+};
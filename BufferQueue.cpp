@@ -0,0 +1,142 @@
+#include "BufferQueue.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <new>
+
+#include <private/shared/PthreadMutexLocker.h>
+
+
+void deadlineFromTimeout(bigtime_t timeout, timespec &deadline)
+{
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000000;
+	deadline.tv_nsec += (timeout % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+}
+
+
+//#pragma mark - BufferQueue
+
+BufferQueue::BufferQueue():
+	fItems(NULL),
+	fMask(0), fMaxLen(0),
+	fMultiProducer(false),
+	fAddLock(PTHREAD_MUTEX_INITIALIZER),
+#ifndef NDEBUG
+	fAdding(false),
+#endif
+	fHead(0), fTail(0), fWaiting(0),
+	fLock(PTHREAD_MUTEX_INITIALIZER),
+	fEmptyCv(PTHREAD_COND_INITIALIZER)
+{}
+
+bool BufferQueue::SetMaxLen(int32 maxLen, bool multiProducer)
+{
+	uint32 capacity = 0;
+	if (!(maxLen > 0)) {
+		fItems.Unset();
+	} else {
+		capacity = 1;
+		while (capacity < (uint32)maxLen)
+			capacity *= 2;
+		auto newItems = new(std::nothrow) int32[capacity];
+		if (newItems == NULL)
+			return false;
+		fItems.SetTo(newItems);
+	}
+	fMask = capacity - 1;
+	fMaxLen = maxLen > 0 ? maxLen : 0;
+	fMultiProducer = multiProducer;
+	fHead = 0; fTail = 0;
+	return true;
+}
+
+
+bool BufferQueue::Add(int32 val)
+{
+	if (fMultiProducer) {
+		PthreadMutexLocker lock(&fAddLock);
+		return AddSingle(val);
+	}
+	return AddSingle(val);
+}
+
+bool BufferQueue::AddSingle(int32 val)
+{
+#ifndef NDEBUG
+	bool adding = fAdding.exchange(true, std::memory_order_acquire);
+	assert(!adding && "concurrent Add() to a single producer BufferQueue");
+	(void)adding;
+#endif
+	bool res = false;
+	uint32 tail = fTail.load(std::memory_order_relaxed);
+	if (tail - fHead.load(std::memory_order_acquire) < fMaxLen) {
+		fItems[tail & fMask] = val;
+		fTail.store(tail + 1, std::memory_order_seq_cst);
+
+		if (fWaiting.load(std::memory_order_seq_cst) > 0) {
+			PthreadMutexLocker lock(&fLock);
+			pthread_cond_signal(&fEmptyCv);
+		}
+		res = true;
+	}
+#ifndef NDEBUG
+	fAdding.store(false, std::memory_order_release);
+#endif
+	return res;
+}
+
+int32 BufferQueue::Remove()
+{
+	int32 res;
+	Remove(res, B_INFINITE_TIMEOUT);
+	return res;
+}
+
+status_t BufferQueue::Remove(int32 &val, bigtime_t timeout)
+{
+	if (TryRemove(val))
+		return B_OK;
+	if (timeout <= 0)
+		return B_WOULD_BLOCK;
+
+	timespec deadline;
+	if (timeout != B_INFINITE_TIMEOUT)
+		deadlineFromTimeout(timeout, deadline);
+
+	// Add() only signals when it sees a waiter, so announce ourselves before
+	// checking the queue again.
+	PthreadMutexLocker lock(&fLock);
+	fWaiting.fetch_add(1, std::memory_order_seq_cst);
+	status_t res = B_OK;
+	while (!TryRemove(val)) {
+		if (timeout == B_INFINITE_TIMEOUT) {
+			pthread_cond_wait(&fEmptyCv, &fLock);
+		} else if (pthread_cond_timedwait(&fEmptyCv, &fLock, &deadline) == ETIMEDOUT) {
+			if (!TryRemove(val))
+				res = B_TIMED_OUT;
+			break;
+		}
+	}
+	fWaiting.fetch_sub(1, std::memory_order_relaxed);
+	return res;
+}
+
+bool BufferQueue::TryRemove(int32 &val)
+{
+	uint32 head = fHead.load(std::memory_order_relaxed);
+	if (head == fTail.load(std::memory_order_seq_cst))
+		return false;
+	val = fItems[head & fMask];
+	fHead.store(head + 1, std::memory_order_release);
+	return true;
+}
+
+int32 BufferQueue::Length()
+{
+	return fTail.load(std::memory_order_acquire) - fHead.load(std::memory_order_acquire);
+}
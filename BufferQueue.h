@@ -0,0 +1,52 @@
+#pragma once
+
+#include <OS.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <atomic>
+
+#include <private/shared/AutoDeleter.h>
+
+
+// Absolute CLOCK_REALTIME time after timeout, for pthread_cond_timedwait().
+void deadlineFromTimeout(bigtime_t timeout, timespec &deadline);
+
+// Ring of image indices with a single consumer. Both ends only touch atomics,
+// the mutex and condition variable are used by a consumer that has to wait for
+// an empty queue to be filled.
+//
+// Add() must not be called by two threads at once, unless the queue was set up
+// with multiProducer, then Add() is serialized by fAddLock. Debug builds assert
+// that a single producer queue is not added to concurrently. Remove() and
+// TryRemove() must not be called by two threads at once.
+class BufferQueue {
+private:
+	static constexpr size_t kCacheLineSize = 64;
+
+	ArrayDeleter<int32> fItems;
+	uint32 fMask, fMaxLen;
+	bool fMultiProducer;
+	pthread_mutex_t fAddLock;
+#ifndef NDEBUG
+	std::atomic<bool> fAdding;
+#endif
+	alignas(kCacheLineSize) std::atomic<uint32> fHead;
+	alignas(kCacheLineSize) std::atomic<uint32> fTail;
+	alignas(kCacheLineSize) std::atomic<int32> fWaiting;
+	pthread_mutex_t fLock;
+	pthread_cond_t fEmptyCv;
+
+public:
+	BufferQueue();
+	bool SetMaxLen(int32 maxLen, bool multiProducer = false);
+
+	bool Add(int32 val);
+	int32 Remove();
+	status_t Remove(int32 &val, bigtime_t timeout);
+	bool TryRemove(int32 &val);
+	int32 Length();
+
+private:
+	bool AddSingle(int32 val);
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <new>
+
+#include <private/shared/PthreadMutexLocker.h>
+
+
+// Maps dispatchable Vulkan handles to layer objects. The key is the loader
+// dispatch table pointer stored at the start of every dispatchable handle, so
+// all handles sharing a dispatch table (a device and its queues) resolve to
+// the same object.
+//
+// Lookups are lock-free. Updates are serialized by a mutex and never move a
+// published slot: removed entries keep their key with a NULL value, and a
+// table that becomes too full is copied into a larger one. Replaced tables
+// are kept until the map is destroyed because readers may still probe them.
+
+template<typename Value>
+class DispatchMap {
+private:
+	struct Slot {
+		std::atomic<void*> key{};
+		std::atomic<Value*> value{};
+	};
+
+	struct Table {
+		Table *prev;
+		uint32_t mask;
+		uint32_t used;
+		Slot *slots;
+	};
+
+	pthread_mutex_t fLock = PTHREAD_MUTEX_INITIALIZER;
+	std::atomic<Table*> fTable{};
+
+	static uint32_t Hash(void *key)
+	{
+		return (uint32_t)(((uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ULL) >> 32);
+	}
+
+	static Slot *Find(Table *table, void *key)
+	{
+		for (uint32_t i = Hash(key);; i++) {
+			Slot &slot = table->slots[i & table->mask];
+			void *slotKey = slot.key.load(std::memory_order_acquire);
+			if (slotKey == key) return &slot;
+			if (slotKey == NULL) return NULL;
+		}
+	}
+
+	static Slot &FindFree(Table *table, void *key)
+	{
+		for (uint32_t i = Hash(key);; i++) {
+			Slot &slot = table->slots[i & table->mask];
+			if (slot.key.load(std::memory_order_relaxed) == NULL) return slot;
+		}
+	}
+
+	bool Grow()
+	{
+		Table *oldTable = fTable.load(std::memory_order_relaxed);
+		uint32_t liveCnt = 0;
+		if (oldTable != NULL) {
+			for (uint32_t i = 0; i <= oldTable->mask; i++) {
+				if (oldTable->slots[i].value.load(std::memory_order_relaxed) != NULL)
+					liveCnt++;
+			}
+		}
+		uint32_t capacity = 16;
+		while (capacity < 4*(liveCnt + 1))
+			capacity *= 2;
+
+		Table *table = new(std::nothrow) Table{oldTable, capacity - 1, 0, new(std::nothrow) Slot[capacity]};
+		if (table == NULL || table->slots == NULL) {
+			if (table != NULL) delete table;
+			return false;
+		}
+		if (oldTable != NULL) {
+			for (uint32_t i = 0; i <= oldTable->mask; i++) {
+				void *key = oldTable->slots[i].key.load(std::memory_order_relaxed);
+				Value *value = oldTable->slots[i].value.load(std::memory_order_relaxed);
+				if (value == NULL) continue;
+				Slot &slot = FindFree(table, key);
+				slot.value.store(value, std::memory_order_relaxed);
+				slot.key.store(key, std::memory_order_relaxed);
+				table->used++;
+			}
+		}
+		fTable.store(table, std::memory_order_release);
+		return true;
+	}
+
+public:
+	~DispatchMap()
+	{
+		Table *table = fTable.load(std::memory_order_relaxed);
+		while (table != NULL) {
+			Table *prev = table->prev;
+			delete[] table->slots;
+			delete table;
+			table = prev;
+		}
+	}
+
+	static void *DispatchKey(const void *handle)
+	{
+		if (handle == NULL) return NULL;
+		return *(void *const*)handle;
+	}
+
+	Value *Lookup(const void *handle)
+	{
+		void *key = DispatchKey(handle);
+		Table *table = fTable.load(std::memory_order_acquire);
+		if (key == NULL || table == NULL) return NULL;
+		Slot *slot = Find(table, key);
+		if (slot == NULL) return NULL;
+		return slot->value.load(std::memory_order_acquire);
+	}
+
+	bool Insert(const void *handle, Value *value)
+	{
+		void *key = DispatchKey(handle);
+		PthreadMutexLocker lock(&fLock);
+		Table *table = fTable.load(std::memory_order_relaxed);
+		if (table != NULL) {
+			Slot *slot = Find(table, key);
+			if (slot != NULL) {
+				slot->value.store(value, std::memory_order_release);
+				return true;
+			}
+		}
+		if (table == NULL || 4*(table->used + 1) > 3*(table->mask + 1)) {
+			if (!Grow()) return false;
+			table = fTable.load(std::memory_order_relaxed);
+		}
+		Slot &slot = FindFree(table, key);
+		slot.value.store(value, std::memory_order_relaxed);
+		slot.key.store(key, std::memory_order_release);
+		table->used++;
+		return true;
+	}
+
+	Value *Remove(const void *handle)
+	{
+		void *key = DispatchKey(handle);
+		PthreadMutexLocker lock(&fLock);
+		Table *table = fTable.load(std::memory_order_relaxed);
+		if (key == NULL || table == NULL) return NULL;
+		Slot *slot = Find(table, key);
+		if (slot == NULL) return NULL;
+		return slot->value.exchange(NULL, std::memory_order_acq_rel);
+	}
+};
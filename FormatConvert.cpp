@@ -0,0 +1,269 @@
+#include "FormatConvert.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+// B_RGB32 is B, G, R, A in memory, a little endian 0xAARRGGBB. Other
+// architectures than x86 use the scalar code and rely on the compiler to
+// vectorize it.
+
+
+//#pragma mark - scalar
+
+static inline uint32_t SwapRedBlue(uint32_t v)
+{
+	return (v & 0xff00ff00) | ((v & 0xff) << 16) | ((v >> 16) & 0xff);
+}
+
+template<int kRedShift, int kBlueShift>
+static inline uint32_t Rgb10ToRgb32(uint32_t v)
+{
+	uint32_t alpha = v & 0xc0000000;
+	alpha |= alpha >> 2;
+	alpha |= alpha >> 4;
+	return
+		((v >> (kBlueShift + 2)) & 0xff) |
+		(((v >> 12) & 0xff) << 8) |
+		(((v >> (kRedShift + 2)) & 0xff) << 16) |
+		alpha;
+}
+
+static inline float HalfToFloat(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+	uint32_t bits;
+	if (exp == 0x1f) {
+		bits = sign | 0x7f800000 | (mant << 13);
+	} else if (exp != 0) {
+		bits = sign | ((exp + 112) << 23) | (mant << 13);
+	} else {
+		// Denormals are far below the precision of the result.
+		bits = sign;
+	}
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static inline uint32_t UnitToByte(float f)
+{
+	// NaN ends up as 0.
+	if (!(f > 0.0f))
+		return 0;
+	if (f >= 1.0f)
+		return 255;
+	return (uint32_t)(f * 255.0f + 0.5f);
+}
+
+static inline uint32_t Rgba16FloatToRgb32(const uint16_t *v)
+{
+	return
+		UnitToByte(HalfToFloat(v[2])) |
+		(UnitToByte(HalfToFloat(v[1])) << 8) |
+		(UnitToByte(HalfToFloat(v[0])) << 16) |
+		(UnitToByte(HalfToFloat(v[3])) << 24);
+}
+
+static inline uint32_t Rgba16ToRgb32(const uint16_t *v)
+{
+	return (v[2] >> 8) | (v[1] & 0xff00) | ((uint32_t)(v[0] >> 8) << 16) | ((uint32_t)(v[3] >> 8) << 24);
+}
+
+#if !defined(__SSE2__)
+static void ConvertRgba8Scalar(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint32_t *s = (const uint32_t*)src;
+	for (uint32_t x = 0; x < width; x++)
+		dst[x] = SwapRedBlue(s[x]);
+}
+
+template<int kRedShift, int kBlueShift>
+static void ConvertRgb10Scalar(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint32_t *s = (const uint32_t*)src;
+	for (uint32_t x = 0; x < width; x++)
+		dst[x] = Rgb10ToRgb32<kRedShift, kBlueShift>(s[x]);
+}
+
+static void ConvertRgba16Scalar(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint16_t *s = (const uint16_t*)src;
+	for (uint32_t x = 0; x < width; x++)
+		dst[x] = Rgba16ToRgb32(s + 4*x);
+}
+#endif
+
+static void ConvertRgba16FloatScalar(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint16_t *s = (const uint16_t*)src;
+	for (uint32_t x = 0; x < width; x++)
+		dst[x] = Rgba16FloatToRgb32(s + 4*x);
+}
+
+
+//#pragma mark - SSE2
+
+#if defined(__SSE2__)
+static inline __m128i SwapRedBlueSse2(__m128i v)
+{
+	const __m128i greenAlpha = _mm_set1_epi32(0xff00ff00);
+	const __m128i low = _mm_set1_epi32(0xff);
+	__m128i redBlue = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, low), 16), _mm_and_si128(_mm_srli_epi32(v, 16), low));
+	return _mm_or_si128(_mm_and_si128(v, greenAlpha), redBlue);
+}
+
+static void ConvertRgba8Sse2(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint32_t *s = (const uint32_t*)src;
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4)
+		_mm_storeu_si128((__m128i*)(dst + x), SwapRedBlueSse2(_mm_loadu_si128((const __m128i*)(s + x))));
+	for (; x < width; x++)
+		dst[x] = SwapRedBlue(s[x]);
+}
+
+template<int kRedShift, int kBlueShift>
+static void ConvertRgb10Sse2(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint32_t *s = (const uint32_t*)src;
+	const __m128i low = _mm_set1_epi32(0xff);
+	const __m128i alphaMask = _mm_set1_epi32(0xc0000000);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(s + x));
+		__m128i alpha = _mm_and_si128(v, alphaMask);
+		alpha = _mm_or_si128(alpha, _mm_srli_epi32(alpha, 2));
+		alpha = _mm_or_si128(alpha, _mm_srli_epi32(alpha, 4));
+		__m128i blue = _mm_and_si128(_mm_srli_epi32(v, kBlueShift + 2), low);
+		__m128i green = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 12), low), 8);
+		__m128i red = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, kRedShift + 2), low), 16);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_or_si128(blue, green), _mm_or_si128(red, alpha)));
+	}
+	for (; x < width; x++)
+		dst[x] = Rgb10ToRgb32<kRedShift, kBlueShift>(s[x]);
+}
+
+static void ConvertRgba16Sse2(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint16_t *s = (const uint16_t*)src;
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i lo = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(s + 4*x)), 8);
+		__m128i hi = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(s + 4*x + 8)), 8);
+		_mm_storeu_si128((__m128i*)(dst + x), SwapRedBlueSse2(_mm_packus_epi16(lo, hi)));
+	}
+	for (; x < width; x++)
+		dst[x] = Rgba16ToRgb32(s + 4*x);
+}
+#endif
+
+
+//#pragma mark - F16C
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2,f16c")))
+static inline __m128i HalfPixelToInt(const uint16_t *s)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(255.0f);
+	__m128 f = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)s));
+	// Operand order makes NaN clamp to 0.
+	f = _mm_min_ps(_mm_max_ps(f, zero), one);
+	return _mm_cvtps_epi32(_mm_mul_ps(f, scale));
+}
+
+__attribute__((target("sse2,f16c")))
+static void ConvertRgba16FloatF16c(uint32_t *dst, const void *src, uint32_t width)
+{
+	const uint16_t *s = (const uint16_t*)src;
+	const __m128i greenAlpha = _mm_set1_epi32(0xff00ff00);
+	const __m128i low = _mm_set1_epi32(0xff);
+	uint32_t x = 0;
+	for (; x + 4 <= width; x += 4) {
+		__m128i lo = _mm_packs_epi32(HalfPixelToInt(s + 4*x), HalfPixelToInt(s + 4*x + 4));
+		__m128i hi = _mm_packs_epi32(HalfPixelToInt(s + 4*x + 8), HalfPixelToInt(s + 4*x + 12));
+		__m128i v = _mm_packus_epi16(lo, hi);
+		__m128i redBlue = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, low), 16), _mm_and_si128(_mm_srli_epi32(v, 16), low));
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_and_si128(v, greenAlpha), redBlue));
+	}
+	for (; x < width; x++)
+		dst[x] = Rgba16FloatToRgb32(s + 4*x);
+}
+#endif
+
+
+//#pragma mark -
+
+color_space NativeColorSpace(VkFormat format)
+{
+	switch (format) {
+		case VK_FORMAT_B8G8R8A8_UNORM:
+		case VK_FORMAT_B8G8R8A8_SRGB:
+			return B_RGB32;
+		case VK_FORMAT_R5G6B5_UNORM_PACK16:
+			return B_RGB16;
+		case VK_FORMAT_A1R5G5B5_UNORM_PACK16:
+			return B_RGB15;
+		default:
+			return B_NO_COLOR_SPACE;
+	}
+}
+
+bool FindRgb32Conversion(VkFormat format, FormatConversion &conversion)
+{
+	switch (format) {
+		// Same bytes as R8G8B8A8 on little endian.
+		case VK_FORMAT_R8G8B8A8_UNORM:
+		case VK_FORMAT_R8G8B8A8_SRGB:
+		case VK_FORMAT_A8B8G8R8_UNORM_PACK32:
+		case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+			conversion.srcPixelSize = 4;
+#if defined(__SSE2__)
+			conversion.convertRow = ConvertRgba8Sse2;
+#else
+			conversion.convertRow = ConvertRgba8Scalar;
+#endif
+			return true;
+		case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+			conversion.srcPixelSize = 4;
+#if defined(__SSE2__)
+			conversion.convertRow = ConvertRgb10Sse2<0, 20>;
+#else
+			conversion.convertRow = ConvertRgb10Scalar<0, 20>;
+#endif
+			return true;
+		case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+			conversion.srcPixelSize = 4;
+#if defined(__SSE2__)
+			conversion.convertRow = ConvertRgb10Sse2<20, 0>;
+#else
+			conversion.convertRow = ConvertRgb10Scalar<20, 0>;
+#endif
+			return true;
+		case VK_FORMAT_R16G16B16A16_UNORM:
+			conversion.srcPixelSize = 8;
+#if defined(__SSE2__)
+			conversion.convertRow = ConvertRgba16Sse2;
+#else
+			conversion.convertRow = ConvertRgba16Scalar;
+#endif
+			return true;
+		case VK_FORMAT_R16G16B16A16_SFLOAT:
+			conversion.srcPixelSize = 8;
+			conversion.convertRow = ConvertRgba16FloatScalar;
+#if defined(__x86_64__) || defined(__i386__)
+			if (__builtin_cpu_supports("f16c"))
+				conversion.convertRow = ConvertRgba16FloatF16c;
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <GraphicsDefs.h>
+
+#define VK_NO_PROTOTYPES
+#include <vulkan/vulkan.h>
+
+
+// Bitmap color space with the memory layout of format, B_NO_COLOR_SPACE if
+// there is none.
+color_space NativeColorSpace(VkFormat format);
+
+typedef void (*ConvertRowFunc)(uint32_t *dst, const void *src, uint32_t width);
+
+struct FormatConversion {
+	uint32_t srcPixelSize;
+	ConvertRowFunc convertRow;
+};
+
+// Finds the conversion of format to B_RGB32 done on the CPU, for formats that
+// a blit can not convert or not exactly. The fastest implementation supported
+// by the CPU is picked.
+bool FindRgb32Conversion(VkFormat format, FormatConversion &conversion);
@@ -1,21 +1,25 @@
 #include "Layer.h"
 #include "Wsi.h"
+#include "DispatchMap.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 
+#include <algorithm>
+#include <iterator>
 #include <map>
+#include <string_view>
 
 #include <OS.h>
 #include <private/shared/AutoDeleter.h>
+#include <private/shared/AutoDeleterOS.h>
 #include <private/shared/PthreadMutexLocker.h>
 
 
-pthread_mutex_t sInstanceMapLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
-std::map<VkInstance, ObjectDeleter<LayerInstance>> sInstanceMap;
-pthread_mutex_t sDeviceMapLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
-std::map<VkDevice, ObjectDeleter<LayerDevice>> sDeviceMap;
+DispatchMap<LayerInstance> sInstanceMap;
+DispatchMap<LayerInstance> sPhysDevMap;
+DispatchMap<LayerDevice> sDeviceMap;
 
 
 VkResult ExtensionProperties(const uint32_t count, const VkExtensionProperties *properties, uint32_t *pCount, VkExtensionProperties *pProperties)
@@ -24,9 +28,11 @@ VkResult ExtensionProperties(const uint32_t count, const VkExtensionProperties *
 		*pCount = count;
 		return VK_SUCCESS;
 	}
-	memcpy(pProperties, properties, std::min<uint32_t>(count, *pCount));
+	uint32_t copyCnt = std::min<uint32_t>(count, *pCount);
+	memcpy(pProperties, properties, sizeof(VkExtensionProperties)*copyCnt);
 	if (*pCount < count)
 		return VK_INCOMPLETE;
+	*pCount = copyCnt;
 	return VK_SUCCESS;
 }
 
@@ -34,7 +40,8 @@ VkResult ExtensionProperties(const uint32_t count, const VkExtensionProperties *
 //#pragma mark - LayerInstance
 
 LayerInstance::LayerInstance():
-	fBaseInstance(VK_NULL_HANDLE)
+	fBaseInstance(VK_NULL_HANDLE),
+	fPhysDevInfoLock(PTHREAD_MUTEX_INITIALIZER)
 {
 }
 
@@ -59,7 +66,7 @@ VkResult LayerInstance::Init(const VkInstanceCreateInfo* pCreateInfo, const VkAl
 	fBaseInstance = *pInstance;
 
 #define REQUIRED(x) fHooks.x = (PFN_vk##x)fHooks.GetInstanceProcAddr(fBaseInstance, "vk" #x);
-#define OPTIONAL(x)
+#define OPTIONAL(x) REQUIRED(x)
 	INSTANCE_HOOK_LIST(REQUIRED, OPTIONAL);
 #undef REQUIRED
 #undef OPTIONAL
@@ -72,26 +79,107 @@ PFN_vkVoidFunction LayerInstance::GetInstanceProcAddr(const char* pName)
 	return fHooks.GetInstanceProcAddr(fBaseInstance, pName);
 }
 
+void LayerInstance::InitPhysDevInfo(VkPhysicalDevice physDev, PhysDevInfo &info)
+{
+	fHooks.GetPhysicalDeviceProperties(physDev, &info.properties);
+	fHooks.GetPhysicalDeviceMemoryProperties(physDev, &info.memoryProperties);
+
+	uint32_t familyCnt = 0;
+	fHooks.GetPhysicalDeviceQueueFamilyProperties(physDev, &familyCnt, NULL);
+	info.queueFamilies.resize(familyCnt);
+	fHooks.GetPhysicalDeviceQueueFamilyProperties(physDev, &familyCnt, info.queueFamilies.data());
+
+	info.externalMemoryHost = false;
+	info.minImportedHostPointerAlignment = 0;
+	uint32_t extensionCnt = 0;
+	if (fHooks.EnumerateDeviceExtensionProperties(physDev, NULL, &extensionCnt, NULL) == VK_SUCCESS) {
+		std::vector<VkExtensionProperties> extensions(extensionCnt);
+		if (fHooks.EnumerateDeviceExtensionProperties(physDev, NULL, &extensionCnt, extensions.data()) >= VK_SUCCESS) {
+			for (uint32_t i = 0; i < extensionCnt; i++) {
+				if (strcmp(extensions[i].extensionName, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME) == 0)
+					info.externalMemoryHost = true;
+			}
+		}
+	}
+	if (info.externalMemoryHost && fHooks.GetPhysicalDeviceProperties2 != NULL) {
+		VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProps{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT};
+		VkPhysicalDeviceProperties2 props{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &hostProps};
+		fHooks.GetPhysicalDeviceProperties2(physDev, &props);
+		info.minImportedHostPointerAlignment = hostProps.minImportedHostPointerAlignment;
+	}
+
+	constexpr int max_core_1_0_formats = VK_FORMAT_ASTC_12x12_SRGB_BLOCK + 1;
+	for (int format = 0; format < max_core_1_0_formats; format++) {
+		VkImageFormatProperties formatProps;
+		VkResult res = fHooks.GetPhysicalDeviceImageFormatProperties(
+			physDev, (VkFormat)format, VK_IMAGE_TYPE_2D,
+			VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT,
+			&formatProps
+		);
+		if (res != VK_ERROR_FORMAT_NOT_SUPPORTED) {
+			info.surfaceFormats.push_back((VkFormat)format);
+		}
+	}
+}
+
+const PhysDevInfo &LayerInstance::GetPhysDevInfo(VkPhysicalDevice physDev)
+{
+	PthreadMutexLocker lock(&fPhysDevInfoLock);
+	auto it = fPhysDevInfos.find(physDev);
+	if (it == fPhysDevInfos.end()) {
+		it = fPhysDevInfos.emplace(physDev, PhysDevInfo{}).first;
+		InitPhysDevInfo(physDev, it->second);
+	}
+	return it->second;
+}
+
 LayerInstance *LayerInstance::FromHandle(VkInstance instance)
 {
-	PthreadMutexLocker lock(&sInstanceMapLock);
-	auto it = sInstanceMap.find(instance);
-	if (it == sInstanceMap.end()) return NULL;
-	return it->second.Get();
+	return sInstanceMap.Lookup(instance);
 }
 
 LayerInstance *LayerInstance::FromPhysDev(VkPhysicalDevice physDev)
 {
-	(void)physDev;
-	PthreadMutexLocker lock(&sInstanceMapLock);
-	// !!!
-	return sInstanceMap.begin()->second.Get();
+	LayerInstance *layerInst = sPhysDevMap.Lookup(physDev);
+	if (layerInst != NULL) return layerInst;
+	// Not enumerated through this layer, loaders usually share the instance dispatch table.
+	return sInstanceMap.Lookup(physDev);
+}
+
+VkResult LayerInstance::RegisterPhysDevs(uint32_t count, const VkPhysicalDevice *physDevs)
+{
+	PthreadMutexLocker lock(&fPhysDevInfoLock);
+	for (uint32_t i = 0; i < count; i++) {
+		if (std::find(fPhysDevs.begin(), fPhysDevs.end(), physDevs[i]) != fPhysDevs.end())
+			continue;
+		if (!sPhysDevMap.Insert(physDevs[i], this))
+			return VK_ERROR_OUT_OF_HOST_MEMORY;
+		fPhysDevs.push_back(physDevs[i]);
+	}
+	return VK_SUCCESS;
+}
+
+void LayerInstance::UnregisterPhysDevs()
+{
+	PthreadMutexLocker lock(&fPhysDevInfoLock);
+	for (VkPhysicalDevice physDev: fPhysDevs) {
+		if (sPhysDevMap.Lookup(physDev) == this)
+			sPhysDevMap.Remove(physDev);
+	}
+	fPhysDevs.clear();
 }
 
 
 //#pragma mark - LayerDevice
 
-LayerDevice::LayerDevice(LayerInstance *instance): fInstance(instance), fBaseDevice(VK_NULL_HANDLE), fPhysDev(VK_NULL_HANDLE)
+LayerDevice::LayerDevice(LayerInstance *instance): fInstance(instance), fBaseDevice(VK_NULL_HANDLE), fPhysDev(VK_NULL_HANDLE), fPhysDevInfo(NULL),
+	fTransferFamily(UINT32_MAX), fTransferQueueIdx(0), fTransferQueue(VK_NULL_HANDLE),
+	fBlitFamily(UINT32_MAX), fBlitQueueIdx(0), fBlitQueue(VK_NULL_HANDLE),
+	fSharedQueue(VK_NULL_HANDLE),
+	fQueueLock(PTHREAD_MUTEX_INITIALIZER),
+	fMemoryPool(this),
+	fFenceLock(PTHREAD_MUTEX_INITIALIZER),
+	fHostImportTypeBits(0)
 {}
 
 LayerDevice::~LayerDevice()
@@ -100,6 +188,7 @@ LayerDevice::~LayerDevice()
 VkResult LayerDevice::Init(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDevice* pDevice)
 {
 	fPhysDev = physicalDevice;
+	fPhysDevInfo = &fInstance->GetPhysDevInfo(physicalDevice);
 
 	VkLayerDeviceCreateInfo *layerCreateInfo = (VkLayerDeviceCreateInfo *)pCreateInfo->pNext;
 	while (layerCreateInfo && !(layerCreateInfo->sType == VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO && layerCreateInfo->function == VK_LAYER_LINK_INFO)) {
@@ -110,6 +199,33 @@ VkResult LayerDevice::Init(VkPhysicalDevice physicalDevice, const VkDeviceCreate
 		return VK_ERROR_INITIALIZATION_FAILED;
 	}
 
+	PFN_vkSetDeviceLoaderData setDeviceLoaderData = NULL;
+	for (auto *item = (const VkLayerDeviceCreateInfo*)pCreateInfo->pNext; item != NULL; item = (const VkLayerDeviceCreateInfo*)item->pNext) {
+		if (item->sType == VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO && item->function == VK_LOADER_DATA_CALLBACK)
+			setDeviceLoaderData = item->u.pfnSetDeviceLoaderData;
+	}
+
+	VkDeviceCreateInfo createInfo = *pCreateInfo;
+	std::vector<VkDeviceQueueCreateInfo> queueInfos;
+	std::vector<float> priorities;
+	if (AddTransferQueue(*pCreateInfo, queueInfos, priorities)) {
+		createInfo.queueCreateInfoCount = queueInfos.size();
+		createInfo.pQueueCreateInfos = queueInfos.data();
+	}
+
+	// Readback memory is shared with the consumer as areas imported by the
+	// device where supported.
+	std::vector<const char*> extensions(pCreateInfo->ppEnabledExtensionNames, pCreateInfo->ppEnabledExtensionNames + pCreateInfo->enabledExtensionCount);
+	bool externalMemoryHost = std::find_if(extensions.begin(), extensions.end(), [](const char *name) {
+		return strcmp(name, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME) == 0;
+	}) != extensions.end();
+	if (!externalMemoryHost && fPhysDevInfo->externalMemoryHost) {
+		extensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+		createInfo.enabledExtensionCount = extensions.size();
+		createInfo.ppEnabledExtensionNames = extensions.data();
+		externalMemoryHost = true;
+	}
+
 	fHooks.GetInstanceProcAddr = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
 	fHooks.GetDeviceProcAddr = layerCreateInfo->u.pLayerInfo->pfnNextGetDeviceProcAddr;
 	// move chain on for next layer
@@ -118,29 +234,246 @@ VkResult LayerDevice::Init(VkPhysicalDevice physicalDevice, const VkDeviceCreate
   fHooks.GetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)fHooks.GetDeviceProcAddr(fBaseDevice, "vkGetDeviceProcAddr");
   fHooks.CreateDevice = (PFN_vkCreateDevice)fHooks.GetInstanceProcAddr(VK_NULL_HANDLE, "vkCreateDevice");
 
-	VkCheckRet(fHooks.CreateDevice(physicalDevice, pCreateInfo, pAllocator, pDevice));
+	VkCheckRet(fHooks.CreateDevice(physicalDevice, &createInfo, pAllocator, pDevice));
 	fBaseDevice = *pDevice;
 
 #define REQUIRED(x) fHooks.x = (PFN_vk##x)fHooks.GetDeviceProcAddr(fBaseDevice, "vk" #x);
-#define OPTIONAL(x)
+#define OPTIONAL(x) REQUIRED(x)
 	DEVICE_HOOK_LIST(REQUIRED, OPTIONAL);
 #undef REQUIRED
 #undef OPTIONAL
 
+	if (!externalMemoryHost)
+		fHooks.GetMemoryHostPointerPropertiesEXT = NULL;
+	InitHostImport();
+
+	VkResult res = InitQueues(*pCreateInfo, setDeviceLoaderData);
+	if (res != VK_SUCCESS) {
+		fHooks.DestroyDevice(fBaseDevice, pAllocator);
+		return res;
+	}
+
 	return VK_SUCCESS;
 }
 
+VkResult LayerDevice::InitQueues(const VkDeviceCreateInfo &createInfo, PFN_vkSetDeviceLoaderData setDeviceLoaderData)
+{
+	for (uint32_t i = 0; i < createInfo.queueCreateInfoCount; i++) {
+		const VkDeviceQueueCreateInfo &info = createInfo.pQueueCreateInfos[i];
+		for (uint32_t j = 0; j < info.queueCount; j++) {
+			VkQueue queue = VK_NULL_HANDLE;
+			if (info.flags == 0) {
+				fHooks.GetDeviceQueue(fBaseDevice, info.queueFamilyIndex, j, &queue);
+			} else if (fHooks.GetDeviceQueue2 != NULL) {
+				VkDeviceQueueInfo2 queueInfo{
+					.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_INFO_2,
+					.flags = info.flags,
+					.queueFamilyIndex = info.queueFamilyIndex,
+					.queueIndex = j
+				};
+				fHooks.GetDeviceQueue2(fBaseDevice, &queueInfo, &queue);
+			}
+			if (queue == VK_NULL_HANDLE)
+				continue;
+			fQueueFamilies[queue] = info.queueFamilyIndex;
+			if (fTransferFamily == UINT32_MAX && fSharedQueue == VK_NULL_HANDLE && info.flags == 0)
+				fSharedQueue = queue;
+		}
+	}
+
+	// Queues the application never retrieves are not dispatchable yet.
+	if (fTransferFamily == UINT32_MAX) {
+		if (fSharedQueue != VK_NULL_HANDLE && setDeviceLoaderData != NULL)
+			VkCheckRet(setDeviceLoaderData(fBaseDevice, fSharedQueue));
+		return VK_SUCCESS;
+	}
+	fHooks.GetDeviceQueue(fBaseDevice, fTransferFamily, fTransferQueueIdx, &fTransferQueue);
+	if (setDeviceLoaderData != NULL)
+		VkCheckRet(setDeviceLoaderData(fBaseDevice, fTransferQueue));
+
+	if ((fPhysDevInfo->queueFamilies[fTransferFamily].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0) {
+		fBlitFamily = fTransferFamily;
+		fBlitQueue = fTransferQueue;
+	} else if (fBlitFamily != UINT32_MAX) {
+		fHooks.GetDeviceQueue(fBaseDevice, fBlitFamily, fBlitQueueIdx, &fBlitQueue);
+		if (setDeviceLoaderData != NULL)
+			VkCheckRet(setDeviceLoaderData(fBaseDevice, fBlitQueue));
+	}
+
+	return VK_SUCCESS;
+}
+
+void LayerDevice::InitHostImport()
+{
+	// Areas are only page aligned.
+	if (fHooks.GetMemoryHostPointerPropertiesEXT == NULL || fPhysDevInfo->minImportedHostPointerAlignment > B_PAGE_SIZE)
+		return;
+
+	void *address = NULL;
+	AreaDeleter area(create_area("WSI import probe", &address, B_ANY_ADDRESS, B_PAGE_SIZE, B_FULL_LOCK, B_READ_AREA | B_WRITE_AREA));
+	if (!area.IsSet())
+		return;
+	VkMemoryHostPointerPropertiesEXT props{.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT};
+	if (fHooks.GetMemoryHostPointerPropertiesEXT(fBaseDevice, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, address, &props) == VK_SUCCESS)
+		fHostImportTypeBits = props.memoryTypeBits;
+}
+
+// Appends a queue of family to queueInfos and returns its index. priorities
+// must have room for the priorities of all queues of the device.
+static uint32_t addQueue(std::vector<VkDeviceQueueCreateInfo> &queueInfos, std::vector<float> &priorities, uint32_t family)
+{
+	static const float kPriority = 1.0f;
+	for (VkDeviceQueueCreateInfo &info: queueInfos) {
+		if (info.queueFamilyIndex != family || info.flags != 0)
+			continue;
+		size_t start = priorities.size();
+		priorities.insert(priorities.end(), info.pQueuePriorities, info.pQueuePriorities + info.queueCount);
+		priorities.push_back(kPriority);
+		info.pQueuePriorities = priorities.data() + start;
+		return info.queueCount++;
+	}
+	queueInfos.push_back(VkDeviceQueueCreateInfo{
+		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+		.queueFamilyIndex = family,
+		.queueCount = 1,
+		.pQueuePriorities = &kPriority
+	});
+	return 0;
+}
+
+bool LayerDevice::AddTransferQueue(const VkDeviceCreateInfo &createInfo, std::vector<VkDeviceQueueCreateInfo> &queueInfos, std::vector<float> &priorities)
+{
+	const std::vector<VkQueueFamilyProperties> &families = fPhysDevInfo->queueFamilies;
+	std::vector<uint32_t> usedCnt(families.size());
+	uint32_t queueCnt = 0;
+	for (uint32_t i = 0; i < createInfo.queueCreateInfoCount; i++) {
+		const VkDeviceQueueCreateInfo &info = createInfo.pQueueCreateInfos[i];
+		if (info.queueFamilyIndex < families.size())
+			usedCnt[info.queueFamilyIndex] += info.queueCount;
+		queueCnt += info.queueCount;
+	}
+
+	// Prefer the family with the least graphics work: dedicated transfer
+	// queues first, then compute queues.
+	int32_t family = -1;
+	int32_t familyRank = 0;
+	for (uint32_t i = 0; i < families.size(); i++) {
+		VkQueueFlags flags = families[i].queueFlags;
+		if ((flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT)) == 0 || usedCnt[i] >= families[i].queueCount)
+			continue;
+		int32_t rank = (flags & VK_QUEUE_GRAPHICS_BIT) ? 1 : (flags & VK_QUEUE_COMPUTE_BIT) ? 2 : 3;
+		if (rank > familyRank) {
+			family = i;
+			familyRank = rank;
+		}
+	}
+
+	// Every queue is taken, presents then run on the presenting queue.
+	if (family < 0)
+		return false;
+	fTransferFamily = family;
+	usedCnt[family]++;
+
+	// Blits need a graphics queue, which gets reserved as well if the
+	// transfer queue is none. Without one blits run on the presenting queue.
+	if ((families[fTransferFamily].queueFlags & VK_QUEUE_GRAPHICS_BIT) == 0) {
+		for (uint32_t i = 0; i < families.size(); i++) {
+			if ((families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0 && usedCnt[i] < families[i].queueCount) {
+				fBlitFamily = i;
+				break;
+			}
+		}
+	}
+
+	queueInfos.assign(createInfo.pQueueCreateInfos, createInfo.pQueueCreateInfos + createInfo.queueCreateInfoCount);
+	priorities.reserve(queueCnt + 2);
+	fTransferQueueIdx = addQueue(queueInfos, priorities, fTransferFamily);
+	if (fBlitFamily != UINT32_MAX)
+		fBlitQueueIdx = addQueue(queueInfos, priorities, fBlitFamily);
+	return true;
+}
+
 PFN_vkVoidFunction LayerDevice::GetDeviceProcAddr(const char* pName)
 {
 	return fHooks.GetDeviceProcAddr(fBaseDevice, pName);
 }
 
+uint32_t LayerDevice::GetQueueFamily(VkQueue queue)
+{
+	auto it = fQueueFamilies.find(queue);
+	if (it == fQueueFamilies.end())
+		return UINT32_MAX;
+	return it->second;
+}
+
+VkResult LayerDevice::Submit(VkQueue queue, uint32_t submitCnt, const VkSubmitInfo *submits, VkFence fence)
+{
+	if (!OwnsQueue(queue) && !IsSharedQueue(queue))
+		return fHooks.QueueSubmit(queue, submitCnt, submits, fence);
+	PthreadMutexLocker lock(&fQueueLock);
+	return fHooks.QueueSubmit(queue, submitCnt, submits, fence);
+}
+
+VkResult LayerDevice::SubmitTransfer(uint32_t submitCnt, const VkSubmitInfo *submits, VkFence fence)
+{
+	VkQueue queue = fTransferQueue != VK_NULL_HANDLE ? fTransferQueue : fSharedQueue;
+	if (queue == VK_NULL_HANDLE)
+		return VK_ERROR_INITIALIZATION_FAILED;
+	PthreadMutexLocker lock(&fQueueLock);
+	return fHooks.QueueSubmit(queue, submitCnt, submits, fence);
+}
+
+VkResult LayerDevice::AcquireFence(VkFence &fence)
+{
+	{
+		PthreadMutexLocker lock(&fFenceLock);
+		if (!fFreeFences.empty()) {
+			fence = fFreeFences.back();
+			fFreeFences.pop_back();
+			return VK_SUCCESS;
+		}
+	}
+	VkFenceCreateInfo fenceInfo{.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+	return fHooks.CreateFence(fBaseDevice, &fenceInfo, NULL, &fence);
+}
+
+void LayerDevice::RecycleFence(VkFence fence)
+{
+	if (fHooks.ResetFences(fBaseDevice, 1, &fence) != VK_SUCCESS) {
+		fHooks.DestroyFence(fBaseDevice, fence, NULL);
+		return;
+	}
+	PthreadMutexLocker lock(&fFenceLock);
+	fFreeFences.push_back(fence);
+}
+
+void LayerDevice::ClearFences()
+{
+	PthreadMutexLocker lock(&fFenceLock);
+	for (VkFence fence: fFreeFences)
+		fHooks.DestroyFence(fBaseDevice, fence, NULL);
+	fFreeFences.clear();
+}
+
+VkResult LayerDevice::WaitTransferIdle()
+{
+	PthreadMutexLocker lock(&fQueueLock);
+	for (VkQueue queue: {fTransferQueue, fBlitQueue != fTransferQueue ? fBlitQueue : VK_NULL_HANDLE, fSharedQueue}) {
+		if (queue != VK_NULL_HANDLE)
+			VkCheckRet(fHooks.QueueWaitIdle(queue));
+	}
+	return VK_SUCCESS;
+}
+
 LayerDevice *LayerDevice::FromHandle(VkDevice device)
 {
-	PthreadMutexLocker lock(&sDeviceMapLock);
-	auto it = sDeviceMap.find(device);
-	if (it == sDeviceMap.end()) return NULL;
-	return it->second.Get();
+	return sDeviceMap.Lookup(device);
+}
+
+LayerDevice *LayerDevice::FromQueue(VkQueue queue)
+{
+	// Queues share the dispatch table of their device.
+	return sDeviceMap.Lookup(queue);
 }
 
 
@@ -153,8 +486,10 @@ static VkResult VKAPI_CALL Layer_CreateInstance(const VkInstanceCreateInfo* pCre
 	ObjectDeleter<LayerInstance> layerInst(new LayerInstance());
 	VkCheckRet(layerInst->Init(pCreateInfo, pAllocator, pInstance));
 
-	PthreadMutexLocker lock(&sInstanceMapLock);
-	sInstanceMap.emplace(layerInst->ToHandle(), layerInst.Get());
+	if (!sInstanceMap.Insert(layerInst->ToHandle(), layerInst.Get())) {
+		layerInst->Hooks().DestroyInstance(layerInst->ToHandle(), pAllocator);
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	}
 	layerInst.Detach();
 
 	return VK_SUCCESS;
@@ -164,16 +499,43 @@ static void VKAPI_CALL Layer_DestroyInstance(VkInstance instance, const VkAlloca
 {
 	(void)pAllocator;
 	printf("VideoStreamsWsi: vkDestroyInstance\n");
-	ObjectDeleter<LayerInstance> layerInst;
-	{
-		PthreadMutexLocker lock(&sInstanceMapLock);
-		auto it = sInstanceMap.find(instance);
-		layerInst.SetTo(it->second.Detach());
-		sInstanceMap.erase(it);
-	}
+	ObjectDeleter<LayerInstance> layerInst(sInstanceMap.Remove(instance));
+	layerInst->UnregisterPhysDevs();
 	layerInst->Hooks().DestroyInstance(instance, pAllocator);
 }
 
+static VkResult VKAPI_CALL Layer_EnumeratePhysicalDevices(VkInstance instance, uint32_t *pPhysicalDeviceCount, VkPhysicalDevice *pPhysicalDevices)
+{
+	LayerInstance *layerInst = LayerInstance::FromHandle(instance);
+	VkResult res = layerInst->Hooks().EnumeratePhysicalDevices(instance, pPhysicalDeviceCount, pPhysicalDevices);
+	if (pPhysicalDevices != NULL && (res == VK_SUCCESS || res == VK_INCOMPLETE))
+		VkCheckRet(layerInst->RegisterPhysDevs(*pPhysicalDeviceCount, pPhysicalDevices));
+	return res;
+}
+
+static VkResult RegisterPhysDevGroups(LayerInstance *layerInst, VkResult res, uint32_t count, const VkPhysicalDeviceGroupProperties *groups)
+{
+	if (groups == NULL || (res != VK_SUCCESS && res != VK_INCOMPLETE))
+		return res;
+	for (uint32_t i = 0; i < count; i++)
+		VkCheckRet(layerInst->RegisterPhysDevs(groups[i].physicalDeviceCount, groups[i].physicalDevices));
+	return res;
+}
+
+static VkResult VKAPI_CALL Layer_EnumeratePhysicalDeviceGroups(VkInstance instance, uint32_t *pPhysicalDeviceGroupCount, VkPhysicalDeviceGroupProperties *pPhysicalDeviceGroupProperties)
+{
+	LayerInstance *layerInst = LayerInstance::FromHandle(instance);
+	VkResult res = layerInst->Hooks().EnumeratePhysicalDeviceGroups(instance, pPhysicalDeviceGroupCount, pPhysicalDeviceGroupProperties);
+	return RegisterPhysDevGroups(layerInst, res, *pPhysicalDeviceGroupCount, pPhysicalDeviceGroupProperties);
+}
+
+static VkResult VKAPI_CALL Layer_EnumeratePhysicalDeviceGroupsKHR(VkInstance instance, uint32_t *pPhysicalDeviceGroupCount, VkPhysicalDeviceGroupProperties *pPhysicalDeviceGroupProperties)
+{
+	LayerInstance *layerInst = LayerInstance::FromHandle(instance);
+	VkResult res = layerInst->Hooks().EnumeratePhysicalDeviceGroupsKHR(instance, pPhysicalDeviceGroupCount, pPhysicalDeviceGroupProperties);
+	return RegisterPhysDevGroups(layerInst, res, *pPhysicalDeviceGroupCount, pPhysicalDeviceGroupProperties);
+}
+
 static VkResult VKAPI_CALL Layer_EnumerateInstanceLayerProperties(uint32_t *pCount, VkLayerProperties *pProperties)
 {
 	static const VkLayerProperties property = {"VK_LAYER_window_system_integration", VK_MAKE_VERSION(1, 0, VK_HEADER_VERSION), 1, "Window system integration layer"};
@@ -181,7 +543,7 @@ static VkResult VKAPI_CALL Layer_EnumerateInstanceLayerProperties(uint32_t *pCou
 		*pCount = 1;
 		return VK_SUCCESS;
 	}
-	memcpy(pProperties, &property, std::min<uint32_t>(1, *pCount));
+	memcpy(pProperties, &property, sizeof(VkLayerProperties)*std::min<uint32_t>(1, *pCount));
 	if (*pCount < 1)
 		return VK_INCOMPLETE;
 	return VK_SUCCESS;
@@ -197,8 +559,10 @@ static VkResult VKAPI_CALL Layer_CreateDevice(VkPhysicalDevice physicalDevice, c
 	ObjectDeleter<LayerDevice> layerDev(new LayerDevice(LayerInstance::FromPhysDev(physicalDevice)));
 	VkCheckRet(layerDev->Init(physicalDevice, pCreateInfo, pAllocator, pDevice));
 
-	PthreadMutexLocker lock(&sDeviceMapLock);
-	sDeviceMap.emplace(layerDev->ToHandle(), layerDev.Get());
+	if (!sDeviceMap.Insert(layerDev->ToHandle(), layerDev.Get())) {
+		layerDev->Hooks().DestroyDevice(layerDev->ToHandle(), pAllocator);
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	}
 	layerDev.Detach();
 
 	return VK_SUCCESS;
@@ -208,22 +572,77 @@ static void VKAPI_CALL Layer_DestroyDevice(VkDevice device, const VkAllocationCa
 {
 	(void)pAllocator;
 	printf("VideoStreamsWsi: vkDestroyDevice\n");
-	ObjectDeleter<LayerDevice> layerDev;
-	{
-		PthreadMutexLocker lock(&sDeviceMapLock);
-		auto it = sDeviceMap.find(device);
-		layerDev.SetTo(it->second.Detach());
-		sDeviceMap.erase(it);
-	}
+	ObjectDeleter<LayerDevice> layerDev(sDeviceMap.Remove(device));
+	layerDev->GetMemoryPool().Clear();
+	layerDev->ClearFences();
 	layerDev->Hooks().DestroyDevice(device, pAllocator);
 }
 
+// The application's calls on a queue it shares with the layer, only handed
+// out to devices that share one.
+
+static VkResult VKAPI_CALL Layer_QueueSubmit(VkQueue queue, uint32_t submitCount, const VkSubmitInfo *pSubmits, VkFence fence)
+{
+	LayerDevice *layerDev = LayerDevice::FromQueue(queue);
+	if (!layerDev->IsSharedQueue(queue))
+		return layerDev->Hooks().QueueSubmit(queue, submitCount, pSubmits, fence);
+	PthreadMutexLocker lock(layerDev->QueueLock());
+	return layerDev->Hooks().QueueSubmit(queue, submitCount, pSubmits, fence);
+}
+
+static VkResult VKAPI_CALL Layer_QueueSubmit2(VkQueue queue, uint32_t submitCount, const VkSubmitInfo2 *pSubmits, VkFence fence)
+{
+	LayerDevice *layerDev = LayerDevice::FromQueue(queue);
+	if (!layerDev->IsSharedQueue(queue))
+		return layerDev->Hooks().QueueSubmit2(queue, submitCount, pSubmits, fence);
+	PthreadMutexLocker lock(layerDev->QueueLock());
+	return layerDev->Hooks().QueueSubmit2(queue, submitCount, pSubmits, fence);
+}
+
+static VkResult VKAPI_CALL Layer_QueueSubmit2KHR(VkQueue queue, uint32_t submitCount, const VkSubmitInfo2 *pSubmits, VkFence fence)
+{
+	LayerDevice *layerDev = LayerDevice::FromQueue(queue);
+	if (!layerDev->IsSharedQueue(queue))
+		return layerDev->Hooks().QueueSubmit2KHR(queue, submitCount, pSubmits, fence);
+	PthreadMutexLocker lock(layerDev->QueueLock());
+	return layerDev->Hooks().QueueSubmit2KHR(queue, submitCount, pSubmits, fence);
+}
+
+static VkResult VKAPI_CALL Layer_QueueBindSparse(VkQueue queue, uint32_t bindInfoCount, const VkBindSparseInfo *pBindInfo, VkFence fence)
+{
+	LayerDevice *layerDev = LayerDevice::FromQueue(queue);
+	if (!layerDev->IsSharedQueue(queue))
+		return layerDev->Hooks().QueueBindSparse(queue, bindInfoCount, pBindInfo, fence);
+	PthreadMutexLocker lock(layerDev->QueueLock());
+	return layerDev->Hooks().QueueBindSparse(queue, bindInfoCount, pBindInfo, fence);
+}
+
+static VkResult VKAPI_CALL Layer_QueueWaitIdle(VkQueue queue)
+{
+	LayerDevice *layerDev = LayerDevice::FromQueue(queue);
+	if (!layerDev->IsSharedQueue(queue))
+		return layerDev->Hooks().QueueWaitIdle(queue);
+	PthreadMutexLocker lock(layerDev->QueueLock());
+	return layerDev->Hooks().QueueWaitIdle(queue);
+}
+
+static VkResult VKAPI_CALL Layer_DeviceWaitIdle(VkDevice device)
+{
+	LayerDevice *layerDev = LayerDevice::FromHandle(device);
+	PthreadMutexLocker lock(layerDev->QueueLock());
+	return layerDev->Hooks().DeviceWaitIdle(device);
+}
+
 static VkResult VKAPI_CALL Layer_EnumerateDeviceExtensionProperties(VkPhysicalDevice physicalDevice, const char *pLayerName, uint32_t *pCount, VkExtensionProperties *pProperties)
 {
 	printf("VideoStreamsWsi: vkEnumerateDeviceExtensionProperties\n");
 	if (pLayerName && !strcmp(pLayerName, "VK_LAYER_window_system_integration")) {
 		static const VkExtensionProperties extensions[] = {
-			{VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_SWAPCHAIN_SPEC_VERSION}
+			{VK_KHR_SWAPCHAIN_EXTENSION_NAME, VK_KHR_SWAPCHAIN_SPEC_VERSION},
+			{VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME, VK_KHR_INCREMENTAL_PRESENT_SPEC_VERSION},
+			{VK_KHR_PRESENT_ID_EXTENSION_NAME, VK_KHR_PRESENT_ID_SPEC_VERSION},
+			{VK_KHR_PRESENT_WAIT_EXTENSION_NAME, VK_KHR_PRESENT_WAIT_SPEC_VERSION},
+			{VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME, VK_EXT_SWAPCHAIN_MAINTENANCE_1_SPEC_VERSION}
 		};
 		return ExtensionProperties(B_COUNT_OF(extensions), extensions, pCount, pProperties);
 	}
@@ -232,30 +651,131 @@ static VkResult VKAPI_CALL Layer_EnumerateDeviceExtensionProperties(VkPhysicalDe
 }
 
 
+// Report support for features of the extensions implemented by the layer.
+static void AddLayerFeatures(VkPhysicalDeviceFeatures2 *pFeatures)
+{
+	for (auto *item = (VkBaseOutStructure*)pFeatures->pNext; item != NULL; item = item->pNext) {
+		switch (item->sType) {
+			case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR:
+				((VkPhysicalDevicePresentIdFeaturesKHR*)item)->presentId = VK_TRUE;
+				break;
+			case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR:
+				((VkPhysicalDevicePresentWaitFeaturesKHR*)item)->presentWait = VK_TRUE;
+				break;
+			case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT:
+				((VkPhysicalDeviceSwapchainMaintenance1FeaturesEXT*)item)->swapchainMaintenance1 = VK_TRUE;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+// Either entry point may be missing below the layer, the other one or the
+// core features query stands in for it.
+static void GetFeatures2(VkPhysicalDevice physicalDevice, VkPhysicalDeviceFeatures2 *pFeatures, PFN_vkGetPhysicalDeviceFeatures2 preferred, PFN_vkGetPhysicalDeviceFeatures2 fallback)
+{
+	if (preferred != NULL)
+		preferred(physicalDevice, pFeatures);
+	else if (fallback != NULL)
+		fallback(physicalDevice, pFeatures);
+	else
+		LayerInstance::FromPhysDev(physicalDevice)->Hooks().GetPhysicalDeviceFeatures(physicalDevice, &pFeatures->features);
+	AddLayerFeatures(pFeatures);
+}
+
+static void VKAPI_CALL Layer_GetPhysicalDeviceFeatures2(VkPhysicalDevice physicalDevice, VkPhysicalDeviceFeatures2 *pFeatures)
+{
+	InstanceHooks &hooks = LayerInstance::FromPhysDev(physicalDevice)->Hooks();
+	GetFeatures2(physicalDevice, pFeatures, hooks.GetPhysicalDeviceFeatures2, hooks.GetPhysicalDeviceFeatures2KHR);
+}
+
+static void VKAPI_CALL Layer_GetPhysicalDeviceFeatures2KHR(VkPhysicalDevice physicalDevice, VkPhysicalDeviceFeatures2 *pFeatures)
+{
+	InstanceHooks &hooks = LayerInstance::FromPhysDev(physicalDevice)->Hooks();
+	GetFeatures2(physicalDevice, pFeatures, hooks.GetPhysicalDeviceFeatures2KHR, hooks.GetPhysicalDeviceFeatures2);
+}
+
+
 //#pragma mark - exports
 
-#define GET_PROC_ADDR(func) if (!strcmp(pName, "vk" #func)) return (PFN_vkVoidFunction)&Layer_##func
+// Entry point lists must be kept sorted by name, this is checked at compile time.
+
+#define INSTANCE_PROC_LIST(PROC) \
+	PROC(CreateDevice) \
+	PROC(CreateHeadlessSurfaceEXT) \
+	PROC(CreateInstance) \
+	PROC(DestroyInstance) \
+	PROC(DestroySurfaceKHR) \
+	PROC(EnumerateDeviceExtensionProperties) \
+	PROC(EnumerateInstanceLayerProperties) \
+	PROC(EnumeratePhysicalDeviceGroups) \
+	PROC(EnumeratePhysicalDeviceGroupsKHR) \
+	PROC(EnumeratePhysicalDevices) \
+	PROC(GetPhysicalDeviceFeatures2) \
+	PROC(GetPhysicalDeviceFeatures2KHR) \
+	PROC(GetPhysicalDevicePresentRectanglesKHR) \
+	PROC(GetPhysicalDeviceSurfaceCapabilities2KHR) \
+	PROC(GetPhysicalDeviceSurfaceCapabilitiesKHR) \
+	PROC(GetPhysicalDeviceSurfaceFormats2KHR) \
+	PROC(GetPhysicalDeviceSurfaceFormatsKHR) \
+	PROC(GetPhysicalDeviceSurfacePresentModesKHR) \
+	PROC(GetPhysicalDeviceSurfaceSupportKHR)
+
+#define DEVICE_PROC_LIST(PROC) \
+	PROC(AcquireNextImageKHR) \
+	PROC(CreateSwapchainKHR) \
+	PROC(DestroyDevice) \
+	PROC(DestroySwapchainKHR) \
+	PROC(GetDeviceGroupSurfacePresentModesKHR) \
+	PROC(GetSwapchainImagesKHR) \
+	PROC(QueuePresentKHR) \
+	PROC(ReleaseSwapchainImagesEXT) \
+	PROC(WaitForPresentKHR)
+
+#define SHARED_QUEUE_PROC_LIST(PROC) \
+	PROC(DeviceWaitIdle) \
+	PROC(QueueBindSparse) \
+	PROC(QueueSubmit) \
+	PROC(QueueSubmit2) \
+	PROC(QueueSubmit2KHR) \
+	PROC(QueueWaitIdle)
+
+#define PROC_NAME(func) "vk" #func,
+#define PROC_FUNC(func) (PFN_vkVoidFunction)&Layer_##func,
+
+static constexpr std::string_view sInstanceProcNames[] = {INSTANCE_PROC_LIST(PROC_NAME)};
+static const PFN_vkVoidFunction sInstanceProcs[] = {INSTANCE_PROC_LIST(PROC_FUNC)};
+static constexpr std::string_view sDeviceProcNames[] = {DEVICE_PROC_LIST(PROC_NAME)};
+static const PFN_vkVoidFunction sDeviceProcs[] = {DEVICE_PROC_LIST(PROC_FUNC)};
+static constexpr std::string_view sSharedQueueProcNames[] = {SHARED_QUEUE_PROC_LIST(PROC_NAME)};
+static const PFN_vkVoidFunction sSharedQueueProcs[] = {SHARED_QUEUE_PROC_LIST(PROC_FUNC)};
+
+static_assert(std::is_sorted(std::begin(sInstanceProcNames), std::end(sInstanceProcNames)));
+static_assert(std::is_sorted(std::begin(sDeviceProcNames), std::end(sDeviceProcNames)));
+static_assert(std::is_sorted(std::begin(sSharedQueueProcNames), std::end(sSharedQueueProcNames)));
+
+#undef PROC_NAME
+#undef PROC_FUNC
+
+
+template<size_t count>
+static PFN_vkVoidFunction LookupProc(const std::string_view (&names)[count], const PFN_vkVoidFunction (&procs)[count], const char *pName)
+{
+	std::string_view name(pName);
+	auto it = std::lower_bound(std::begin(names), std::end(names), name);
+	if (it == std::end(names) || *it != name)
+		return NULL;
+	return procs[it - std::begin(names)];
+}
+
 
 extern "C" _EXPORT PFN_vkVoidFunction VKAPI_CALL vkGetInstanceProcAddr(VkInstance instance, const char* pName)
 {
 	//printf("VideoStreamsWsi: vkGetInstanceProcAddr(%p, \"%s\")\n", (void*)instance, pName);
 
-	GET_PROC_ADDR(CreateInstance);
-	GET_PROC_ADDR(DestroyInstance);
-	GET_PROC_ADDR(CreateDevice);
-	GET_PROC_ADDR(EnumerateInstanceLayerProperties);
-	GET_PROC_ADDR(EnumerateDeviceExtensionProperties);
-
-	// WSI surface
-	GET_PROC_ADDR(CreateHeadlessSurfaceEXT);
-	GET_PROC_ADDR(DestroySurfaceKHR);
-	GET_PROC_ADDR(GetPhysicalDevicePresentRectanglesKHR);
-	GET_PROC_ADDR(GetPhysicalDeviceSurfaceCapabilities2KHR);
-	GET_PROC_ADDR(GetPhysicalDeviceSurfaceCapabilitiesKHR);
-	GET_PROC_ADDR(GetPhysicalDeviceSurfaceFormats2KHR);
-	GET_PROC_ADDR(GetPhysicalDeviceSurfaceFormatsKHR);
-	GET_PROC_ADDR(GetPhysicalDeviceSurfacePresentModesKHR);
-	GET_PROC_ADDR(GetPhysicalDeviceSurfaceSupportKHR);
+	PFN_vkVoidFunction proc = LookupProc(sInstanceProcNames, sInstanceProcs, pName);
+	if (proc != NULL) return proc;
 
 	LayerInstance *layerInst = LayerInstance::FromHandle(instance);
 	if (layerInst == NULL) return NULL;
@@ -266,20 +786,17 @@ extern "C" _EXPORT PFN_vkVoidFunction VKAPI_CALL vkGetDeviceProcAddr(VkDevice de
 {
 	//printf("VideoStreamsWsi: vkGetDeviceProcAddr(%p, \"%s\")\n", (void*)device, pName);
 
-	GET_PROC_ADDR(DestroyDevice);
-
-	// WSI surface
-	GET_PROC_ADDR(GetDeviceGroupSurfacePresentModesKHR);
-	// WSI swapchain
-	GET_PROC_ADDR(CreateSwapchainKHR);
-	GET_PROC_ADDR(DestroySwapchainKHR);
-	GET_PROC_ADDR(GetSwapchainImagesKHR);
-	GET_PROC_ADDR(AcquireNextImageKHR);
-	GET_PROC_ADDR(QueuePresentKHR);
+	PFN_vkVoidFunction proc = LookupProc(sDeviceProcNames, sDeviceProcs, pName);
+	if (proc != NULL) return proc;
 
 	LayerDevice *layerDev = LayerDevice::FromHandle(device);
 	if (layerDev == NULL) return NULL;
-	return layerDev->GetDeviceProcAddr(pName);
+	PFN_vkVoidFunction nextProc = layerDev->GetDeviceProcAddr(pName);
+	if (nextProc != NULL && layerDev->SharesQueue()) {
+		proc = LookupProc(sSharedQueueProcNames, sSharedQueueProcs, pName);
+		if (proc != NULL) return proc;
+	}
+	return nextProc;
 }
 
 extern "C" _EXPORT VkResult VKAPI_CALL vkEnumerateInstanceExtensionProperties(const VkEnumerateInstanceExtensionPropertiesChain *chain, const char *pLayerName, uint32_t *pCount, VkExtensionProperties *pProperties)
@@ -288,12 +805,12 @@ extern "C" _EXPORT VkResult VKAPI_CALL vkEnumerateInstanceExtensionProperties(co
 
 	if (pLayerName && !strcmp(pLayerName, "VK_LAYER_window_system_integration")) {
 		static const VkExtensionProperties extensions[] = {
-			{VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_SURFACE_SPEC_VERSION}
+			{VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_SURFACE_SPEC_VERSION},
+			{VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME, VK_KHR_GET_SURFACE_CAPABILITIES_2_SPEC_VERSION},
+			{VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME, VK_EXT_SURFACE_MAINTENANCE_1_SPEC_VERSION}
 		};
 		return ExtensionProperties(B_COUNT_OF(extensions), extensions, pCount, pProperties);
 	}
 
 	return chain->CallDown(pLayerName, pCount, pProperties);
 }
-
-#undef GET_PROC_ADDR
@@ -4,43 +4,72 @@
 #include <vulkan/vulkan.h>
 #include <vulkan/vk_layer.h>
 
+#include <pthread.h>
+
+#include <map>
+#include <vector>
+
+#include "MemoryPool.h"
+
 #define VkCheckRet(err) {VkResult _err = (err); if (_err != VK_SUCCESS) return _err;}
 
 
 #define INSTANCE_HOOK_LIST(REQUIRED, OPTIONAL) \
 	REQUIRED(DestroyInstance) \
 	REQUIRED(EnumerateDeviceExtensionProperties) \
+	REQUIRED(EnumeratePhysicalDevices) \
+	OPTIONAL(EnumeratePhysicalDeviceGroups) \
+	OPTIONAL(EnumeratePhysicalDeviceGroupsKHR) \
+	REQUIRED(GetPhysicalDeviceFeatures) \
+	OPTIONAL(GetPhysicalDeviceFeatures2) \
+	OPTIONAL(GetPhysicalDeviceFeatures2KHR) \
 	REQUIRED(GetPhysicalDeviceImageFormatProperties) \
 	REQUIRED(GetPhysicalDeviceMemoryProperties) \
-	REQUIRED(GetPhysicalDeviceProperties)
+	REQUIRED(GetPhysicalDeviceProperties) \
+	OPTIONAL(GetPhysicalDeviceProperties2) \
+	REQUIRED(GetPhysicalDeviceQueueFamilyProperties)
 
 #define DEVICE_HOOK_LIST(REQUIRED, OPTIONAL) \
 	REQUIRED(DestroyDevice) \
+	REQUIRED(DeviceWaitIdle) \
 	REQUIRED(AllocateCommandBuffers) \
 	REQUIRED(AllocateMemory) \
+	REQUIRED(BindBufferMemory) \
 	REQUIRED(BindImageMemory) \
+	REQUIRED(CreateBuffer) \
 	REQUIRED(CreateCommandPool) \
 	REQUIRED(CreateImage) \
+	REQUIRED(DestroyBuffer) \
 	REQUIRED(DestroyCommandPool) \
 	REQUIRED(DestroyImage) \
 	REQUIRED(FreeCommandBuffers) \
 	REQUIRED(FreeMemory) \
+	REQUIRED(GetBufferMemoryRequirements) \
 	REQUIRED(GetDeviceQueue) \
+	OPTIONAL(GetDeviceQueue2) \
 	REQUIRED(GetImageMemoryRequirements) \
 	REQUIRED(GetImageSubresourceLayout) \
+	REQUIRED(InvalidateMappedMemoryRanges) \
 	REQUIRED(MapMemory) \
 	REQUIRED(ResetFences) \
 	REQUIRED(UnmapMemory) \
 	REQUIRED(CreateFence) \
 	REQUIRED(DestroyFence) \
+	REQUIRED(CreateSemaphore) \
+	REQUIRED(DestroySemaphore) \
 	REQUIRED(WaitForFences) \
 	REQUIRED(BeginCommandBuffer) \
 	REQUIRED(CmdCopyImage) \
+	REQUIRED(CmdCopyImageToBuffer) \
 	REQUIRED(CmdBlitImage) \
 	REQUIRED(CmdPipelineBarrier) \
 	REQUIRED(EndCommandBuffer) \
+	REQUIRED(QueueBindSparse) \
 	REQUIRED(QueueSubmit) \
-	REQUIRED(QueueWaitIdle)
+	OPTIONAL(QueueSubmit2) \
+	OPTIONAL(QueueSubmit2KHR) \
+	REQUIRED(QueueWaitIdle) \
+	OPTIONAL(GetMemoryHostPointerPropertiesEXT)
 
 
 struct InstanceHooks {
@@ -63,11 +92,28 @@ struct DeviceHooks {
 };
 
 
+// Physical device state that does not change, queried once per instance.
+struct PhysDevInfo {
+	VkPhysicalDeviceProperties properties;
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	std::vector<VkFormat> surfaceFormats;
+	std::vector<VkQueueFamilyProperties> queueFamilies;
+	bool externalMemoryHost;
+	VkDeviceSize minImportedHostPointerAlignment;
+};
+
+
 class LayerInstance {
 private:
 	VkInstance fBaseInstance;
 	InstanceHooks fHooks;
 
+	pthread_mutex_t fPhysDevInfoLock;
+	std::map<VkPhysicalDevice, PhysDevInfo> fPhysDevInfos;
+	std::vector<VkPhysicalDevice> fPhysDevs;
+
+	void InitPhysDevInfo(VkPhysicalDevice physDev, PhysDevInfo &info);
+
 public:
 	LayerInstance();
 	~LayerInstance();
@@ -78,7 +124,10 @@ public:
 	static LayerInstance *FromHandle(VkInstance instance);
 	VkInstance ToHandle() {return fBaseInstance;}
 	static LayerInstance *FromPhysDev(VkPhysicalDevice physDev);
+	VkResult RegisterPhysDevs(uint32_t count, const VkPhysicalDevice *physDevs);
+	void UnregisterPhysDevs();
 	InstanceHooks &Hooks() {return fHooks;}
+	const PhysDevInfo &GetPhysDevInfo(VkPhysicalDevice physDev);
 };
 
 
@@ -87,8 +136,39 @@ private:
 	LayerInstance *fInstance;
 	VkDevice fBaseDevice;
 	VkPhysicalDevice fPhysDev;
+	const PhysDevInfo *fPhysDevInfo;
 	DeviceHooks fHooks;
 
+	// Queue for the layer's own submissions, added to the device when a
+	// family has one to spare. UINT32_MAX and VK_NULL_HANDLE otherwise.
+	uint32_t fTransferFamily;
+	uint32_t fTransferQueueIdx;
+	VkQueue fTransferQueue;
+	// Blits need a graphics queue. This is fTransferQueue if it has one,
+	// otherwise another one is added if a graphics family has one to spare.
+	uint32_t fBlitFamily;
+	uint32_t fBlitQueueIdx;
+	VkQueue fBlitQueue;
+	// Without a queue of its own, work outside of a present call goes to an
+	// application queue. The application's calls on it are then serialized
+	// with the layer's by Layer_QueueSubmit() and friends.
+	VkQueue fSharedQueue;
+	// Serializes submissions to the queues above.
+	pthread_mutex_t fQueueLock;
+	// Families of the application's queues, not changed after Init().
+	std::map<VkQueue, uint32_t> fQueueFamilies;
+
+	MemoryPool fMemoryPool;
+	// Fences of finished layer submissions, reset for reuse.
+	pthread_mutex_t fFenceLock;
+	std::vector<VkFence> fFreeFences;
+	// Memory types areas can be imported as, 0 if import is not possible.
+	uint32_t fHostImportTypeBits;
+
+	bool AddTransferQueue(const VkDeviceCreateInfo &createInfo, std::vector<VkDeviceQueueCreateInfo> &queueInfos, std::vector<float> &priorities);
+	void InitHostImport();
+	VkResult InitQueues(const VkDeviceCreateInfo &createInfo, PFN_vkSetDeviceLoaderData setDeviceLoaderData);
+
 public:
 	LayerDevice(LayerInstance *instance);
 	~LayerDevice();
@@ -97,8 +177,32 @@ public:
 	PFN_vkVoidFunction GetDeviceProcAddr(const char* pName);
 
 	static LayerDevice *FromHandle(VkDevice device);
+	static LayerDevice *FromQueue(VkQueue queue);
 	VkDevice ToHandle() {return fBaseDevice;}
 	LayerInstance *GetInstance() {return fInstance;}
 	VkPhysicalDevice GetPhysDev() {return fPhysDev;}
+	const PhysDevInfo &GetPhysDevInfo() {return *fPhysDevInfo;}
 	DeviceHooks &Hooks() {return fHooks;}
+	MemoryPool &GetMemoryPool() {return fMemoryPool;}
+	VkResult AcquireFence(VkFence &fence);
+	void RecycleFence(VkFence fence);
+	void ClearFences();
+	uint32_t GetHostImportTypeBits() {return fHostImportTypeBits;}
+
+	uint32_t GetTransferFamily() {return fTransferFamily;}
+	VkQueue GetTransferQueue() {return fTransferQueue;}
+	uint32_t GetBlitFamily() {return fBlitFamily;}
+	VkQueue GetBlitQueue() {return fBlitQueue;}
+	// UINT32_MAX for queues the application did not create.
+	uint32_t GetQueueFamily(VkQueue queue);
+	bool SharesQueue() {return fSharedQueue != VK_NULL_HANDLE;}
+	bool IsSharedQueue(VkQueue queue) {return SharesQueue() && queue == fSharedQueue;}
+	bool OwnsQueue(VkQueue queue) {return queue != VK_NULL_HANDLE && (queue == fTransferQueue || queue == fBlitQueue);}
+	pthread_mutex_t *QueueLock() {return &fQueueLock;}
+	// Submits to one of the layer's queues, or to an application queue the
+	// caller has synchronized for the call.
+	VkResult Submit(VkQueue queue, uint32_t submitCnt, const VkSubmitInfo *submits, VkFence fence);
+	// Submits work outside of a present call.
+	VkResult SubmitTransfer(uint32_t submitCnt, const VkSubmitInfo *submits, VkFence fence);
+	VkResult WaitTransferIdle();
 };
@@ -0,0 +1,130 @@
+#include "MemoryPool.h"
+#include "Layer.h"
+
+#include <private/shared/AutoDeleterOS.h>
+#include <private/shared/PthreadMutexLocker.h>
+
+
+MemoryPool::MemoryPool(LayerDevice *device):
+	fDevice(device),
+	fLock(PTHREAD_MUTEX_INITIALIZER),
+	fFreeSize(0)
+{}
+
+MemoryPool::~MemoryPool()
+{
+	// Blocks must be given back with Clear() while the device still exists.
+}
+
+VkDeviceSize MemoryPool::RoundSize(VkDeviceSize size)
+{
+	// Steps of 1/8 of the size magnitude keep the waste below 12.5%.
+	VkDeviceSize step = kMinSizeStep;
+	while (step * 16 <= size)
+		step *= 2;
+	return (size + step - 1) / step * step;
+}
+
+VkResult MemoryPool::AllocBlock(VkDeviceSize size, uint32_t memoryTypeIdx, bool hostAccess, MemoryBlock &block)
+{
+	VkMemoryAllocateInfo memAllocInfo{
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = size,
+		.memoryTypeIndex = memoryTypeIdx
+	};
+
+	VkImportMemoryHostPointerInfoEXT hostPtrInfo;
+	AreaDeleter memArea;
+	void *memAreaAdr = NULL;
+	bool hostImport = hostAccess && (fDevice->GetHostImportTypeBits() & (1u << memoryTypeIdx)) != 0;
+	if (hostImport) {
+		memArea.SetTo(create_area("WSI image", &memAreaAdr, B_ANY_ADDRESS, size, B_FULL_LOCK, B_READ_AREA | B_WRITE_AREA | B_CLONEABLE_AREA));
+		if (!memArea.IsSet())
+			return VK_ERROR_OUT_OF_HOST_MEMORY;
+		hostPtrInfo = {
+			.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
+			.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+			.pHostPointer = memAreaAdr
+		};
+		memAllocInfo.pNext = &hostPtrInfo;
+	}
+
+	VkCheckRet(fDevice->Hooks().AllocateMemory(fDevice->ToHandle(), &memAllocInfo, nullptr, &block.memory));
+
+	// Non-coherent memory can only be invalidated while it is mapped. Mappings
+	// are kept until the memory is freed.
+	VkMemoryPropertyFlags properties = fDevice->GetPhysDevInfo().memoryProperties.memoryTypes[memoryTypeIdx].propertyFlags;
+	void *mapping = NULL;
+	if ((properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0 && ((hostAccess && !hostImport) || (properties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)) {
+		VkResult res = fDevice->Hooks().MapMemory(fDevice->ToHandle(), block.memory, 0, VK_WHOLE_SIZE, 0, &mapping);
+		if (res != VK_SUCCESS) {
+			fDevice->Hooks().FreeMemory(fDevice->ToHandle(), block.memory, NULL);
+			block.memory = VK_NULL_HANDLE;
+			return res;
+		}
+	}
+	block.size = size;
+	block.memoryTypeIdx = memoryTypeIdx;
+	block.hostAccess = hostAccess;
+	block.area = memArea.Detach();
+	block.address = hostImport ? memAreaAdr : mapping;
+	return VK_SUCCESS;
+}
+
+VkResult MemoryPool::Alloc(VkDeviceSize size, uint32_t memoryTypeIdx, bool hostAccess, MemoryBlock &block)
+{
+	{
+		PthreadMutexLocker lock(&fLock);
+		auto best = fFreeBlocks.end();
+		for (auto it = fFreeBlocks.begin(); it != fFreeBlocks.end(); it++) {
+			if (it->memoryTypeIdx != memoryTypeIdx || it->hostAccess != hostAccess)
+				continue;
+			if (it->size < size || it->size > size + size / 2)
+				continue;
+			if (best == fFreeBlocks.end() || it->size < best->size)
+				best = it;
+		}
+		if (best != fFreeBlocks.end()) {
+			block = *best;
+			fFreeSize -= block.size;
+			fFreeBlocks.erase(best);
+			return VK_SUCCESS;
+		}
+	}
+	return AllocBlock(RoundSize(size), memoryTypeIdx, hostAccess, block);
+}
+
+void MemoryPool::Recycle(MemoryBlock &block)
+{
+	if (block.memory == VK_NULL_HANDLE)
+		return;
+
+	PthreadMutexLocker lock(&fLock);
+	fFreeBlocks.push_back(block);
+	fFreeSize += block.size;
+	block = MemoryBlock();
+
+	// Drop the blocks released first when the cache grows too large.
+	while (fFreeBlocks.size() > kMaxFreeBlocks || fFreeSize > kMaxFreeSize) {
+		fFreeSize -= fFreeBlocks.front().size;
+		Discard(fFreeBlocks.front());
+		fFreeBlocks.erase(fFreeBlocks.begin());
+	}
+}
+
+void MemoryPool::Discard(MemoryBlock &block)
+{
+	fDevice->Hooks().FreeMemory(fDevice->ToHandle(), block.memory, NULL);
+	if (block.area >= 0)
+		delete_area(block.area);
+	block = MemoryBlock();
+}
+
+void MemoryPool::Clear()
+{
+	PthreadMutexLocker lock(&fLock);
+	for (MemoryBlock &block: fFreeBlocks)
+		Discard(block);
+	fFreeBlocks.clear();
+	fFreeSize = 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <OS.h>
+#include <pthread.h>
+
+#include <vector>
+
+#define VK_NO_PROTOTYPES
+#include <vulkan/vulkan.h>
+
+
+class LayerDevice;
+
+struct MemoryBlock {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize size = 0;
+	uint32_t memoryTypeIdx = 0;
+	bool hostAccess = false;
+	// Host memory the block was imported from, -1 for driver allocated blocks.
+	area_id area = -1;
+	// Start of the area, or of the persistent mapping of host accessed
+	// blocks that could not be imported.
+	void *address = NULL;
+};
+
+// Per device cache of memory blocks released by destroyed images. Blocks are
+// allocated in rounded sizes and handed out again for requests of the same
+// memory type that are not much smaller, so recreating a swapchain while a
+// window is resized mostly avoids the driver and the kernel.
+class MemoryPool {
+private:
+	static constexpr uint32_t kMaxFreeBlocks = 16;
+	static constexpr VkDeviceSize kMaxFreeSize = 256*1024*1024;
+	static constexpr VkDeviceSize kMinSizeStep = 64*1024;
+
+	LayerDevice *fDevice;
+	pthread_mutex_t fLock;
+	std::vector<MemoryBlock> fFreeBlocks;
+	VkDeviceSize fFreeSize;
+
+	static VkDeviceSize RoundSize(VkDeviceSize size);
+	VkResult AllocBlock(VkDeviceSize size, uint32_t memoryTypeIdx, bool hostAccess, MemoryBlock &block);
+
+public:
+	MemoryPool(LayerDevice *device);
+	~MemoryPool();
+
+	// Host accessed blocks are imported from an area when the device supports
+	// it for the memory type, otherwise they are mapped.
+	VkResult Alloc(VkDeviceSize size, uint32_t memoryTypeIdx, bool hostAccess, MemoryBlock &block);
+	void Recycle(MemoryBlock &block);
+	void Discard(MemoryBlock &block);
+	void Clear();
+};
@@ -0,0 +1,529 @@
+#include "BitmapHook.h"
+
+#include <vulkan/vulkan.h>
+
+#include <OS.h>
+#include <Bitmap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+// Stress benchmark of presenting through the installed layer. Each thread
+// clears and presents the images of a swapchain on a headless surface of its
+// own, all on one device. The BitmapHook of every surface reads each bitmap
+// once, like a consumer that uploads or converts frames, and gives the
+// previous one back.
+//
+// PresentBenchmark [threads] [frames] [resize interval]
+//
+// With a resize interval, the hooks change their size every that many frames
+// and the threads recreate their swapchains, like while a window is resized.
+//
+// The run is repeated with readback memory of each host visible type, set
+// with VIDEOSTREAMS_WSI_READBACK_MEMORY_TYPE, to compare how fast the
+// consumer reads cached and uncached memory. The layer ignores types its
+// readback buffers can not have. Then both readback paths, into buffers and
+// into linear images with VIDEOSTREAMS_WSI_LINEAR_READBACK, are compared at
+// common screen sizes.
+//
+// Exits with 77, a skipped benchmark for meson, without a suitable device.
+
+static constexpr uint32_t kImageCnt = 3;
+// Resized hooks are slightly smaller, memory of the larger images can be
+// reused for them.
+static constexpr uint32_t kResizeWidthStep = 64;
+static constexpr uint32_t kResizeHeightStep = 36;
+static constexpr int kSkipped = 77;
+
+static const VkExtent2D kSweepSizes[] = {
+	{1366, 768},
+	{1920, 1080},
+	{3840, 2160},
+};
+
+static void check(VkResult res, const char *what)
+{
+	if (res == VK_SUCCESS || res == VK_SUBOPTIMAL_KHR)
+		return;
+	fprintf(stderr, "%s failed: %d\n", what, res);
+	exit(1);
+}
+
+// The handle of a headless surface points to the layer's surface object.
+static VKLayerSurfaceBase *surfaceBase(VkSurfaceKHR surface)
+{
+	return (VKLayerSurfaceBase*)(uintptr_t)surface;
+}
+
+
+//#pragma mark - BenchmarkHook
+
+class BenchmarkHook: public BitmapHook {
+private:
+	BBitmap *fBitmap = NULL;
+	uint32_t fWidth, fHeight;
+	// GetSize() is called by the benchmark thread when it creates a swapchain,
+	// and by the swapchain's present thread while Resize() may toggle it.
+	std::atomic<bool> fResized{false};
+
+public:
+	// Written by the swapchain's present thread, read once it is destroyed.
+	// fReadSum only keeps the reads from being optimized out.
+	uint64_t fReadBytes = 0;
+	bigtime_t fReadTime = 0;
+	uint64_t fReadSum = 0;
+
+	BenchmarkHook(uint32_t width, uint32_t height): fWidth(width), fHeight(height) {}
+	virtual ~BenchmarkHook() {delete fBitmap;}
+
+	// Called by the benchmark thread that presents to the hook.
+	void Resize() {fResized.store(!fResized.load());}
+
+	void GetSize(uint32_t &width, uint32_t &height) override
+	{
+		bool resized = fResized.load();
+		width = resized ? fWidth - kResizeWidthStep : fWidth;
+		height = resized ? fHeight - kResizeHeightStep : fHeight;
+	}
+
+	BBitmap *SetBitmap(BBitmap *bmp) override
+	{
+		// Readback memory the host can not cache is slow to read.
+		bigtime_t start = system_time();
+		const uint64_t *bits = (const uint64_t*)bmp->Bits();
+		size_t wordCnt = bmp->BitsLength() / sizeof(uint64_t);
+		uint64_t sum = 0;
+		for (size_t i = 0; i < wordCnt; i++)
+			sum += bits[i];
+		fReadSum += sum;
+		fReadTime += system_time() - start;
+		fReadBytes += wordCnt * sizeof(uint64_t);
+
+		BBitmap *prevBitmap = fBitmap;
+		fBitmap = bmp;
+		return prevBitmap;
+	}
+};
+
+
+//#pragma mark - Device
+
+// Threads share the queues round robin, Vulkan requires them to be
+// synchronized by the application.
+struct Device {
+	VkInstance instance = VK_NULL_HANDLE;
+	PFN_vkCreateHeadlessSurfaceEXT CreateHeadlessSurfaceEXT = NULL;
+	VkPhysicalDevice physDev = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	uint32_t family = 0;
+	std::vector<VkQueue> queues;
+	std::vector<pthread_mutex_t> queueLocks;
+};
+
+static bool initDevice(Device &dev, uint32_t threadCnt)
+{
+	const char *instanceExtensions[] = {
+		VK_KHR_SURFACE_EXTENSION_NAME,
+		VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME,
+	};
+	VkApplicationInfo appInfo{
+		.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+		.pApplicationName = "PresentBenchmark",
+		.apiVersion = VK_API_VERSION_1_1
+	};
+	VkInstanceCreateInfo instanceInfo{
+		.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+		.pApplicationInfo = &appInfo,
+		.enabledExtensionCount = 2,
+		.ppEnabledExtensionNames = instanceExtensions
+	};
+	if (vkCreateInstance(&instanceInfo, NULL, &dev.instance) != VK_SUCCESS)
+		return false;
+	dev.CreateHeadlessSurfaceEXT = (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(dev.instance, "vkCreateHeadlessSurfaceEXT");
+	if (dev.CreateHeadlessSurfaceEXT == NULL)
+		return false;
+
+	uint32_t physDevCnt = 1;
+	if (vkEnumeratePhysicalDevices(dev.instance, &physDevCnt, &dev.physDev) < 0 || physDevCnt == 0)
+		return false;
+
+	uint32_t familyCnt = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(dev.physDev, &familyCnt, NULL);
+	std::vector<VkQueueFamilyProperties> families(familyCnt);
+	vkGetPhysicalDeviceQueueFamilyProperties(dev.physDev, &familyCnt, families.data());
+	for (dev.family = 0; dev.family < familyCnt; dev.family++) {
+		if ((families[dev.family].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0)
+			break;
+	}
+	if (dev.family == familyCnt)
+		return false;
+
+	// The layer takes a queue of its own if one is left over.
+	uint32_t queueCnt = std::max<uint32_t>(std::min(threadCnt, families[dev.family].queueCount - 1), 1);
+	std::vector<float> priorities(queueCnt, 1.0f);
+	VkDeviceQueueCreateInfo queueInfo{
+		.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+		.queueFamilyIndex = dev.family,
+		.queueCount = queueCnt,
+		.pQueuePriorities = priorities.data()
+	};
+	const char *deviceExtensions[] = {
+		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+	};
+	VkDeviceCreateInfo deviceInfo{
+		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+		.queueCreateInfoCount = 1,
+		.pQueueCreateInfos = &queueInfo,
+		.enabledExtensionCount = 1,
+		.ppEnabledExtensionNames = deviceExtensions
+	};
+	if (vkCreateDevice(dev.physDev, &deviceInfo, NULL, &dev.device) != VK_SUCCESS)
+		return false;
+
+	dev.queues.resize(queueCnt);
+	dev.queueLocks.resize(queueCnt);
+	for (uint32_t i = 0; i < queueCnt; i++) {
+		vkGetDeviceQueue(dev.device, dev.family, i, &dev.queues[i]);
+		pthread_mutex_init(&dev.queueLocks[i], NULL);
+	}
+	return true;
+}
+
+static void freeDevice(Device &dev)
+{
+	for (pthread_mutex_t &lock: dev.queueLocks)
+		pthread_mutex_destroy(&lock);
+	if (dev.device != VK_NULL_HANDLE)
+		vkDestroyDevice(dev.device, NULL);
+	if (dev.instance != VK_NULL_HANDLE)
+		vkDestroyInstance(dev.instance, NULL);
+}
+
+
+//#pragma mark - Swapchain
+
+struct Swapchain {
+	VkSwapchainKHR swapchain = VK_NULL_HANDLE;
+	VkExtent2D extent{};
+	std::vector<VkImage> images;
+	// Clears an image with a color of its own and readies it for presenting.
+	std::vector<VkCommandBuffer> cmds;
+	// Signaled by the clear, waited on by the present of the same image.
+	std::vector<VkSemaphore> renderSems;
+};
+
+static void createSwapchain(Device &dev, VkSurfaceKHR surface, VkCommandPool pool, Swapchain &sc, VkSwapchainKHR oldSwapchain = VK_NULL_HANDLE)
+{
+	VkSurfaceCapabilitiesKHR caps;
+	check(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(dev.physDev, surface, &caps), "vkGetPhysicalDeviceSurfaceCapabilitiesKHR");
+	uint32_t formatCnt = 0;
+	check(vkGetPhysicalDeviceSurfaceFormatsKHR(dev.physDev, surface, &formatCnt, NULL), "vkGetPhysicalDeviceSurfaceFormatsKHR");
+	std::vector<VkSurfaceFormatKHR> formats(formatCnt);
+	check(vkGetPhysicalDeviceSurfaceFormatsKHR(dev.physDev, surface, &formatCnt, formats.data()), "vkGetPhysicalDeviceSurfaceFormatsKHR");
+	VkSurfaceFormatKHR format = formats[0];
+	for (const VkSurfaceFormatKHR &item: formats) {
+		if (item.format == VK_FORMAT_B8G8R8A8_UNORM)
+			format = item;
+	}
+
+	sc.extent = caps.currentExtent;
+	VkSwapchainCreateInfoKHR createInfo{
+		.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+		.surface = surface,
+		.minImageCount = caps.maxImageCount == 0 ? kImageCnt : std::min(kImageCnt, caps.maxImageCount),
+		.imageFormat = format.format,
+		.imageColorSpace = format.colorSpace,
+		.imageExtent = sc.extent,
+		.imageArrayLayers = 1,
+		.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+		.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+		.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+		.presentMode = VK_PRESENT_MODE_FIFO_KHR,
+		.clipped = VK_TRUE,
+		.oldSwapchain = oldSwapchain
+	};
+	VkSwapchainKHR swapchain;
+	check(vkCreateSwapchainKHR(dev.device, &createInfo, NULL, &swapchain), "vkCreateSwapchainKHR");
+	sc.swapchain = swapchain;
+
+	uint32_t imageCnt = 0;
+	check(vkGetSwapchainImagesKHR(dev.device, sc.swapchain, &imageCnt, NULL), "vkGetSwapchainImagesKHR");
+	sc.images.resize(imageCnt);
+	check(vkGetSwapchainImagesKHR(dev.device, sc.swapchain, &imageCnt, sc.images.data()), "vkGetSwapchainImagesKHR");
+
+	sc.cmds.resize(imageCnt);
+	VkCommandBufferAllocateInfo cmdInfo{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = imageCnt
+	};
+	check(vkAllocateCommandBuffers(dev.device, &cmdInfo, sc.cmds.data()), "vkAllocateCommandBuffers");
+
+	sc.renderSems.resize(imageCnt);
+	for (uint32_t i = 0; i < imageCnt; i++) {
+		VkSemaphoreCreateInfo semInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+		check(vkCreateSemaphore(dev.device, &semInfo, NULL, &sc.renderSems[i]), "vkCreateSemaphore");
+
+		VkCommandBufferBeginInfo beginInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+		check(vkBeginCommandBuffer(sc.cmds[i], &beginInfo), "vkBeginCommandBuffer");
+		VkImageSubresourceRange range{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+		VkImageMemoryBarrier barrier{
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.srcAccessMask = 0,
+			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = sc.images[i],
+			.subresourceRange = range
+		};
+		vkCmdPipelineBarrier(sc.cmds[i], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+		VkClearColorValue color{.float32 = {0.25f * i, 0.5f, 1.0f - 0.25f * i, 1.0f}};
+		vkCmdClearColorImage(sc.cmds[i], sc.images[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &color, 1, &range);
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		vkCmdPipelineBarrier(sc.cmds[i], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+		check(vkEndCommandBuffer(sc.cmds[i]), "vkEndCommandBuffer");
+	}
+}
+
+static void freeSwapchain(Device &dev, VkCommandPool pool, Swapchain &sc)
+{
+	for (VkSemaphore sem: sc.renderSems)
+		vkDestroySemaphore(dev.device, sem, NULL);
+	if (!sc.cmds.empty())
+		vkFreeCommandBuffers(dev.device, pool, sc.cmds.size(), sc.cmds.data());
+	vkDestroySwapchainKHR(dev.device, sc.swapchain, NULL);
+	sc = Swapchain();
+}
+
+
+//#pragma mark - PresentThread
+
+struct Options {
+	uint32_t threadCnt = 4;
+	uint32_t frameCnt = 600;
+	uint32_t resizeInterval = 0;
+	uint32_t width = 1920;
+	uint32_t height = 1080;
+};
+
+struct ThreadResult {
+	uint32_t frameCnt = 0;
+	bigtime_t time = 0;
+	// Creation and destruction of swapchains replaced on resize, without
+	// waiting for the queue.
+	uint32_t recreateCnt = 0;
+	bigtime_t createTime = 0;
+	bigtime_t destroyTime = 0;
+	uint64_t readBytes = 0;
+	bigtime_t readTime = 0;
+};
+
+static void recreateSwapchain(Device &dev, VkQueue queue, pthread_mutex_t *queueLock, VkSurfaceKHR surface, VkCommandPool pool, Swapchain &sc, ThreadResult &result)
+{
+	bigtime_t start = system_time();
+	Swapchain newSc;
+	createSwapchain(dev, surface, pool, newSc, sc.swapchain);
+	result.createTime += system_time() - start;
+
+	// The command buffers of the old swapchain may still run.
+	pthread_mutex_lock(queueLock);
+	check(vkQueueWaitIdle(queue), "vkQueueWaitIdle");
+	pthread_mutex_unlock(queueLock);
+
+	start = system_time();
+	freeSwapchain(dev, pool, sc);
+	result.destroyTime += system_time() - start;
+	sc = newSc;
+	result.recreateCnt++;
+}
+
+static void presentFrames(Device &dev, uint32_t threadIdx, const Options &options, ThreadResult &result)
+{
+	VkQueue queue = dev.queues[threadIdx % dev.queues.size()];
+	pthread_mutex_t *queueLock = &dev.queueLocks[threadIdx % dev.queues.size()];
+
+	BenchmarkHook hook(options.width, options.height);
+	VkHeadlessSurfaceCreateInfoEXT surfaceInfo{.sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT};
+	VkSurfaceKHR surface;
+	check(dev.CreateHeadlessSurfaceEXT(dev.instance, &surfaceInfo, NULL, &surface), "vkCreateHeadlessSurfaceEXT");
+	surfaceBase(surface)->SetBitmapHook(&hook);
+
+	VkCommandPoolCreateInfo poolInfo{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.queueFamilyIndex = dev.family
+	};
+	VkCommandPool pool;
+	check(vkCreateCommandPool(dev.device, &poolInfo, NULL, &pool), "vkCreateCommandPool");
+	VkFenceCreateInfo fenceInfo{.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
+	VkFence acquireFence;
+	check(vkCreateFence(dev.device, &fenceInfo, NULL, &acquireFence), "vkCreateFence");
+
+	Swapchain sc;
+	createSwapchain(dev, surface, pool, sc);
+
+	bigtime_t start = system_time();
+	for (uint32_t frame = 0; frame < options.frameCnt; frame++) {
+		if (options.resizeInterval > 0 && frame > 0 && frame % options.resizeInterval == 0) {
+			hook.Resize();
+			recreateSwapchain(dev, queue, queueLock, surface, pool, sc, result);
+		}
+
+		// Waiting for the acquire also waits for the previous clear of the
+		// image, its command buffer can be submitted again.
+		uint32_t imageIdx;
+		check(vkAcquireNextImageKHR(dev.device, sc.swapchain, UINT64_MAX, VK_NULL_HANDLE, acquireFence, &imageIdx), "vkAcquireNextImageKHR");
+		check(vkWaitForFences(dev.device, 1, &acquireFence, VK_TRUE, UINT64_MAX), "vkWaitForFences");
+		check(vkResetFences(dev.device, 1, &acquireFence), "vkResetFences");
+
+		VkSubmitInfo submit{
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			.commandBufferCount = 1,
+			.pCommandBuffers = &sc.cmds[imageIdx],
+			.signalSemaphoreCount = 1,
+			.pSignalSemaphores = &sc.renderSems[imageIdx]
+		};
+		VkPresentInfoKHR presentInfo{
+			.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+			.waitSemaphoreCount = 1,
+			.pWaitSemaphores = &sc.renderSems[imageIdx],
+			.swapchainCount = 1,
+			.pSwapchains = &sc.swapchain,
+			.pImageIndices = &imageIdx
+		};
+		pthread_mutex_lock(queueLock);
+		VkResult res = vkQueueSubmit(queue, 1, &submit, VK_NULL_HANDLE);
+		if (res == VK_SUCCESS)
+			res = vkQueuePresentKHR(queue, &presentInfo);
+		pthread_mutex_unlock(queueLock);
+		check(res, "present");
+		result.frameCnt++;
+	}
+
+	pthread_mutex_lock(queueLock);
+	check(vkQueueWaitIdle(queue), "vkQueueWaitIdle");
+	pthread_mutex_unlock(queueLock);
+	result.time = system_time() - start;
+
+	freeSwapchain(dev, pool, sc);
+	vkDestroyFence(dev.device, acquireFence, NULL);
+	vkDestroyCommandPool(dev.device, pool, NULL);
+	surfaceBase(surface)->SetBitmapHook(NULL);
+	vkDestroySurfaceKHR(dev.instance, surface, NULL);
+	result.readBytes = hook.fReadBytes;
+	result.readTime = hook.fReadTime;
+}
+
+
+// Runs the present threads once, the totals have the time of the whole run.
+static ThreadResult runThreads(Device &dev, const Options &options, bool perThread)
+{
+	std::vector<ThreadResult> results(options.threadCnt);
+	std::vector<std::thread> threads;
+	bigtime_t start = system_time();
+	for (uint32_t i = 0; i < options.threadCnt; i++)
+		threads.emplace_back(presentFrames, std::ref(dev), i, std::cref(options), std::ref(results[i]));
+	for (std::thread &thread: threads)
+		thread.join();
+
+	ThreadResult total;
+	total.time = system_time() - start;
+	for (uint32_t i = 0; i < options.threadCnt; i++) {
+		if (perThread)
+			printf("thread %u: %10.1f frames/s\n", i, results[i].frameCnt * 1000000.0 / results[i].time);
+		total.frameCnt += results[i].frameCnt;
+		total.recreateCnt += results[i].recreateCnt;
+		total.createTime += results[i].createTime;
+		total.destroyTime += results[i].destroyTime;
+		total.readBytes += results[i].readBytes;
+		total.readTime += results[i].readTime;
+	}
+	return total;
+}
+
+static void printRun(const char *name, const ThreadResult &total)
+{
+	printf("%-36s %10.1f frames/s", name, total.frameCnt * 1000000.0 / total.time);
+	if (total.readTime > 0)
+		printf(" %10.1f MB/s consumer reads", total.readBytes * 1000000.0 / total.readTime / (1024 * 1024));
+	printf("\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (argc > 1)
+		options.threadCnt = std::max(atoi(argv[1]), 1);
+	if (argc > 2)
+		options.frameCnt = std::max(atoi(argv[2]), 1);
+	if (argc > 3)
+		options.resizeInterval = std::max(atoi(argv[3]), 0);
+	uint32_t threadCnt = options.threadCnt;
+
+	Device dev;
+	if (!initDevice(dev, threadCnt)) {
+		fprintf(stderr, "no device with VK_EXT_headless_surface\n");
+		freeDevice(dev);
+		return kSkipped;
+	}
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(dev.physDev, &props);
+	printf("%s, %u threads on %zu queues, %ux%u\n", props.deviceName, threadCnt, dev.queues.size(), options.width, options.height);
+
+	ThreadResult total = runThreads(dev, options, true);
+	printRun("total", total);
+	if (total.recreateCnt > 0) {
+		printf("swapchain recreation: %.1f us create, %.1f us destroy\n",
+			(double)total.createTime / total.recreateCnt,
+			(double)total.destroyTime / total.recreateCnt);
+	}
+
+	// The layer picks its readback memory when it allocates, which only
+	// happens on the threads of a run.
+	VkPhysicalDeviceMemoryProperties memProps;
+	vkGetPhysicalDeviceMemoryProperties(dev.physDev, &memProps);
+	for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) {
+		VkMemoryPropertyFlags flags = memProps.memoryTypes[i].propertyFlags;
+		if ((flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
+			continue;
+		char value[16];
+		snprintf(value, sizeof(value), "%u", i);
+		setenv("VIDEOSTREAMS_WSI_READBACK_MEMORY_TYPE", value, 1);
+		char name[64];
+		snprintf(name, sizeof(name), "memory type %u, %s%s", i,
+			(flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) != 0 ? "cached" : "uncached",
+			(flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0 ? ", coherent" : "");
+		printRun(name, runThreads(dev, options, false));
+	}
+	unsetenv("VIDEOSTREAMS_WSI_READBACK_MEMORY_TYPE");
+
+	for (const VkExtent2D &size: kSweepSizes) {
+		Options sweepOptions = options;
+		sweepOptions.width = size.width;
+		sweepOptions.height = size.height;
+		for (bool linear: {false, true}) {
+			setenv("VIDEOSTREAMS_WSI_LINEAR_READBACK", linear ? "1" : "0", 1);
+			char name[64];
+			snprintf(name, sizeof(name), "%ux%u, %s readback", size.width, size.height, linear ? "linear image" : "buffer");
+			printRun(name, runThreads(dev, sweepOptions, false));
+		}
+	}
+	unsetenv("VIDEOSTREAMS_WSI_LINEAR_READBACK");
+
+	freeDevice(dev);
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include "TileCompare.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+typedef bool (*RowsDifferFunc)(const uint8_t *a, size_t aStride, const uint8_t *b, size_t bStride, size_t rowBytes, uint32_t rowCnt);
+
+
+#if !defined(__SSE2__) && !defined(__aarch64__)
+static bool RowsDifferScalar(const uint8_t *a, size_t aStride, const uint8_t *b, size_t bStride, size_t rowBytes, uint32_t rowCnt)
+{
+	for (uint32_t y = 0; y < rowCnt; y++, a += aStride, b += bStride) {
+		if (memcmp(a, b, rowBytes) != 0)
+			return true;
+	}
+	return false;
+}
+#endif
+
+#if defined(__SSE2__)
+static bool RowsDifferSse2(const uint8_t *a, size_t aStride, const uint8_t *b, size_t bStride, size_t rowBytes, uint32_t rowCnt)
+{
+	for (uint32_t y = 0; y < rowCnt; y++, a += aStride, b += bStride) {
+		size_t x = 0;
+		for (; x + 64 <= rowBytes; x += 64) {
+			__m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + x +  0)), _mm_loadu_si128((const __m128i*)(b + x +  0)));
+			__m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + x + 16)), _mm_loadu_si128((const __m128i*)(b + x + 16)));
+			__m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + x + 32)), _mm_loadu_si128((const __m128i*)(b + x + 32)));
+			__m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + x + 48)), _mm_loadu_si128((const __m128i*)(b + x + 48)));
+			__m128i eq = _mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3));
+			if (_mm_movemask_epi8(eq) != 0xffff)
+				return true;
+		}
+		for (; x + 16 <= rowBytes; x += 16) {
+			__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x)));
+			if (_mm_movemask_epi8(eq) != 0xffff)
+				return true;
+		}
+		if (x < rowBytes && memcmp(a + x, b + x, rowBytes - x) != 0)
+			return true;
+	}
+	return false;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static bool RowsDifferAvx2(const uint8_t *a, size_t aStride, const uint8_t *b, size_t bStride, size_t rowBytes, uint32_t rowCnt)
+{
+	for (uint32_t y = 0; y < rowCnt; y++, a += aStride, b += bStride) {
+		size_t x = 0;
+		for (; x + 128 <= rowBytes; x += 128) {
+			__m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + x +  0)), _mm256_loadu_si256((const __m256i*)(b + x +  0)));
+			__m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + x + 32)), _mm256_loadu_si256((const __m256i*)(b + x + 32)));
+			__m256i eq2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + x + 64)), _mm256_loadu_si256((const __m256i*)(b + x + 64)));
+			__m256i eq3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + x + 96)), _mm256_loadu_si256((const __m256i*)(b + x + 96)));
+			__m256i eq = _mm256_and_si256(_mm256_and_si256(eq0, eq1), _mm256_and_si256(eq2, eq3));
+			if (_mm256_movemask_epi8(eq) != -1)
+				return true;
+		}
+		for (; x + 32 <= rowBytes; x += 32) {
+			__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + x)), _mm256_loadu_si256((const __m256i*)(b + x)));
+			if (_mm256_movemask_epi8(eq) != -1)
+				return true;
+		}
+		if (x < rowBytes && memcmp(a + x, b + x, rowBytes - x) != 0)
+			return true;
+	}
+	return false;
+}
+#endif
+
+#if defined(__aarch64__)
+static bool RowsDifferNeon(const uint8_t *a, size_t aStride, const uint8_t *b, size_t bStride, size_t rowBytes, uint32_t rowCnt)
+{
+	for (uint32_t y = 0; y < rowCnt; y++, a += aStride, b += bStride) {
+		size_t x = 0;
+		for (; x + 64 <= rowBytes; x += 64) {
+			uint8x16_t eq0 = vceqq_u8(vld1q_u8(a + x +  0), vld1q_u8(b + x +  0));
+			uint8x16_t eq1 = vceqq_u8(vld1q_u8(a + x + 16), vld1q_u8(b + x + 16));
+			uint8x16_t eq2 = vceqq_u8(vld1q_u8(a + x + 32), vld1q_u8(b + x + 32));
+			uint8x16_t eq3 = vceqq_u8(vld1q_u8(a + x + 48), vld1q_u8(b + x + 48));
+			uint8x16_t eq = vandq_u8(vandq_u8(eq0, eq1), vandq_u8(eq2, eq3));
+			if (vminvq_u8(eq) != 0xff)
+				return true;
+		}
+		for (; x + 16 <= rowBytes; x += 16) {
+			if (vminvq_u8(vceqq_u8(vld1q_u8(a + x), vld1q_u8(b + x))) != 0xff)
+				return true;
+		}
+		if (x < rowBytes && memcmp(a + x, b + x, rowBytes - x) != 0)
+			return true;
+	}
+	return false;
+}
+#endif
+
+
+static RowsDifferFunc SelectRowsDiffer()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		return RowsDifferAvx2;
+#endif
+#if defined(__SSE2__)
+	return RowsDifferSse2;
+#elif defined(__aarch64__)
+	return RowsDifferNeon;
+#else
+	return RowsDifferScalar;
+#endif
+}
+
+bool RowsDiffer(const uint8_t *a, size_t aStride, const uint8_t *b, size_t bStride, size_t rowBytes, uint32_t rowCnt)
+{
+	static const RowsDifferFunc rowsDiffer = SelectRowsDiffer();
+	return rowsDiffer(a, aStride, b, bStride, rowBytes, rowCnt);
+}
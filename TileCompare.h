@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Returns true if any of the first rowBytes bytes of rowCnt rows differ
+// between the two images. The fastest implementation supported by the CPU
+// is picked on first use.
+bool RowsDiffer(const uint8_t *a, size_t aStride, const uint8_t *b, size_t bStride, size_t rowBytes, uint32_t rowCnt);
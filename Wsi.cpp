@@ -1,25 +1,32 @@
 #include "Wsi.h"
+#include "BufferQueue.h"
+#include "BitmapHook.h"
+#include "TileCompare.h"
+#include "FormatConvert.h"
 
 #include <OS.h>
 
 #include <private/shared/AutoDeleter.h>
-#include <private/shared/AutoDeleterOS.h>
 #include <private/shared/PthreadMutexLocker.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 #include <new>
+#include <atomic>
 #include <algorithm>
 #include <cassert>
 
 #include <Bitmap.h>
+#include <Region.h>
 
 
 static uint32_t getMemoryTypeIndex(LayerDevice *lrDev, uint32_t typeBits, VkMemoryPropertyFlags properties)
 {
-	VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
-	lrDev->GetInstance()->Hooks().GetPhysicalDeviceMemoryProperties(lrDev->GetPhysDev(), &deviceMemoryProperties);
+	const VkPhysicalDeviceMemoryProperties &deviceMemoryProperties = lrDev->GetPhysDevInfo().memoryProperties;
 	for (uint32_t i = 0; i < deviceMemoryProperties.memoryTypeCount; i++) {
 		if ((typeBits & 1) == 1) {
 			if ((deviceMemoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
@@ -28,7 +35,71 @@ static uint32_t getMemoryTypeIndex(LayerDevice *lrDev, uint32_t typeBits, VkMemo
 		}
 		typeBits >>= 1;
 	}
-	return 0;
+	return UINT32_MAX;
+}
+
+// Memory the host reads from, in order of preference. Uncached memory is
+// often write combined and very slow to read.
+static const VkMemoryPropertyFlags kReadbackMemoryProperties[] = {
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+};
+
+// Types that areas can be imported as come first, the others are mapped
+// instead. VIDEOSTREAMS_WSI_READBACK_MEMORY_TYPE selects a host visible type
+// by its index, to compare how fast the host reads them.
+static uint32_t getReadbackMemoryTypeIndex(LayerDevice *lrDev, uint32_t typeBits, bool hostArea)
+{
+	const char *memoryType = getenv("VIDEOSTREAMS_WSI_READBACK_MEMORY_TYPE");
+	if (memoryType != NULL) {
+		uint32_t memTypeIdx = strtoul(memoryType, NULL, 10);
+		if (memTypeIdx < 32 && getMemoryTypeIndex(lrDev, typeBits & (1u << memTypeIdx), VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == memTypeIdx)
+			return memTypeIdx;
+	}
+
+	uint32_t importTypeBits = hostArea ? typeBits & lrDev->GetHostImportTypeBits() : 0;
+	for (uint32_t bits: {importTypeBits, typeBits}) {
+		for (VkMemoryPropertyFlags properties: kReadbackMemoryProperties) {
+			uint32_t memTypeIdx = getMemoryTypeIndex(lrDev, bits, properties);
+			if (memTypeIdx != UINT32_MAX)
+				return memTypeIdx;
+		}
+	}
+	return UINT32_MAX;
+}
+
+static bool isMemoryTypeCoherent(LayerDevice *lrDev, uint32_t memTypeIdx)
+{
+	return (lrDev->GetPhysDevInfo().memoryProperties.memoryTypes[memTypeIdx].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+}
+
+static VkResult invalidateMemory(LayerDevice *lrDev, VkDeviceMemory memory)
+{
+	VkMappedMemoryRange range{
+		.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+		.memory = memory,
+		.offset = 0,
+		.size = VK_WHOLE_SIZE
+	};
+	return lrDev->Hooks().InvalidateMappedMemoryRanges(lrDev->ToHandle(), 1, &range);
+}
+
+// Vulkan timeouts are in nanoseconds.
+static bigtime_t timeoutFromVk(uint64_t timeout)
+{
+	if (timeout >= (uint64_t)B_INFINITE_TIMEOUT)
+		return B_INFINITE_TIMEOUT;
+	return (timeout + 999) / 1000;
+}
+
+static const void *findNextStruct(const void *pNext, VkStructureType sType)
+{
+	for (auto *item = (const VkBaseInStructure*)pNext; item != NULL; item = item->pNext) {
+		if (item->sType == sType)
+			return item;
+	}
+	return NULL;
 }
 
 static void insertImageMemoryBarrier(
@@ -66,80 +137,49 @@ static void insertImageMemoryBarrier(
 	);
 }
 
-static VkResult submitWork(LayerDevice *lrDev, VkCommandBuffer cmdBuffer, VkQueue queue)
-{
-	VkSubmitInfo submitInfo{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO};
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &cmdBuffer;
-	VkFenceCreateInfo fenceInfo{.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO};
-	VkFence fence;
-	VkCheckRet(lrDev->Hooks().CreateFence(lrDev->ToHandle(), &fenceInfo, nullptr, &fence));
-	VkCheckRet(lrDev->Hooks().QueueSubmit(queue, 1, &submitInfo, fence));
-	VkCheckRet(lrDev->Hooks().WaitForFences(lrDev->ToHandle(), 1, &fence, VK_TRUE, UINT64_MAX));
-	lrDev->Hooks().DestroyFence(lrDev->ToHandle(), fence, nullptr);
-	return VK_SUCCESS;
-}
-
+//#pragma mark - SharedFence
 
-//#pragma mark - BufferQueue
-
-class BufferQueue {
+// Fence of a layer submission that carries the presents of several
+// swapchains. The last reference gives it back to the device.
+class SharedFence {
 private:
-	ArrayDeleter<int32> fItems;
-	int32 fBeg, fLen, fMaxLen;
-	pthread_mutex_t fLock;
-	pthread_cond_t fEmptyCv, fFullCv;
+	LayerDevice *fDevice;
+	VkFence fFence;
+	std::atomic<int32> fRefCnt;
+
+	SharedFence(LayerDevice *device, VkFence fence): fDevice(device), fFence(fence), fRefCnt(1) {}
+	~SharedFence() {fDevice->RecycleFence(fFence);}
 
 public:
-	BufferQueue();
-	bool SetMaxLen(int32 maxLen);
+	static VkResult Create(LayerDevice *device, SharedFence *&sharedFence);
+	VkFence ToHandle() {return fFence;}
+	VkResult Wait();
 
-	bool Add(int32 val);
-	int32 Remove();
+	void AcquireReference() {fRefCnt.fetch_add(1, std::memory_order_relaxed);}
+	void ReleaseReference();
 };
 
-BufferQueue::BufferQueue():
-	fItems(NULL),
-	fBeg(0), fLen(0), fMaxLen(0),
-	fLock(PTHREAD_RECURSIVE_MUTEX_INITIALIZER),
-	fEmptyCv(PTHREAD_COND_INITIALIZER), fFullCv(PTHREAD_COND_INITIALIZER)
-{}
-
-bool BufferQueue::SetMaxLen(int32 maxLen)
+VkResult SharedFence::Create(LayerDevice *device, SharedFence *&sharedFence)
 {
-	if (!(maxLen > 0)) {
-		fItems.Unset();
-	} else {
-		auto newItems = new(std::nothrow) int32[maxLen];
-		if (newItems == NULL)
-			return false;
-		fItems.SetTo(newItems);
+	VkFence fence;
+	VkCheckRet(device->AcquireFence(fence));
+	sharedFence = new(std::nothrow) SharedFence(device, fence);
+	if (sharedFence == NULL) {
+		device->RecycleFence(fence);
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
 	}
-	fMaxLen = maxLen;
-	fBeg = 0; fLen = 0; fMaxLen = maxLen;
-	return true;
+	return VK_SUCCESS;
 }
 
-
-bool BufferQueue::Add(int32 val)
+VkResult SharedFence::Wait()
 {
-	PthreadMutexLocker lock(&fLock);
-	if (!(fLen < fMaxLen))
-		return false;
-	fItems[(fBeg + fLen)%fMaxLen] = val;
-	if (fLen == 0) pthread_cond_signal(&fEmptyCv);
-	fLen++;
-	return true;
+	return fDevice->Hooks().WaitForFences(fDevice->ToHandle(), 1, &fFence, VK_TRUE, UINT64_MAX);
 }
 
-int32 BufferQueue::Remove()
+void SharedFence::ReleaseReference()
 {
-	PthreadMutexLocker lock(&fLock);
-	while (!(fLen > 0)) pthread_cond_wait(&fEmptyCv, &fLock);
-	int32 res = fItems[fBeg%fMaxLen];
-	fBeg = (fBeg + 1)%fMaxLen;
-	fLen--;
-	return res;
+	if (fRefCnt.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete this;
 }
 
 
@@ -151,37 +191,69 @@ class VKLayerImage {
 private:
 	LayerDevice *fDevice;
 	VkImage fImage;
-	VkDeviceMemory fMemory;
+	MemoryBlock fMemory;
+	bool fCpuMem;
+	bool fHostArea;
+	bool fCoherent;
+	bool fRecycle;
 
 public:
 	VKLayerImage();
 	~VKLayerImage();
-	VkResult Init(LayerDevice *device, const VkImageCreateInfo &createInfo, bool cpuMem = false, area_id *area = NULL);
+	VkResult Init(LayerDevice *device, const VkImageCreateInfo &createInfo, bool cpuMem = false, bool hostArea = false, bool deferAlloc = false);
+	VkResult Allocate();
+	bool IsAllocated() {return fMemory.memory != VK_NULL_HANDLE;}
+	// Memory still referenced elsewhere is freed instead of being reused.
+	void DisableRecycle() {fRecycle = false;}
+	// Drops stale host cache lines after the GPU wrote non-coherent memory.
+	VkResult InvalidateHostCache();
 
 	VkImage ToHandle() {return fImage;}
-	VkDeviceMemory GetMemoryHandle() {return fMemory;}
+	VkDeviceMemory GetMemoryHandle() {return fMemory.memory;}
+	area_id Area() {return fMemory.area;}
+	void *Address() {return fMemory.address;}
 };
 
-class BitmapHook {
-public:
-	virtual ~BitmapHook() {};
-	virtual void GetSize(uint32_t &width, uint32_t &height) = 0;
-	virtual BBitmap *SetBitmap(BBitmap *bmp) = 0;
-};
+// Host visible copy destination without the layout constraints of a linear
+// image, rows can have any pitch.
+class VKLayerBuffer {
+private:
+	LayerDevice *fDevice;
+	VkBuffer fBuffer;
+	MemoryBlock fMemory;
+	bool fCoherent;
+	bool fRecycle;
 
-class VKLayerSurfaceBase {
 public:
-	virtual ~VKLayerSurfaceBase() {};
-	virtual void SetBitmapHook(BitmapHook *hook) = 0;
+	VKLayerBuffer();
+	~VKLayerBuffer();
+	VkResult Init(LayerDevice *device, VkDeviceSize size);
+	void DisableRecycle() {fRecycle = false;}
+	VkResult InvalidateHostCache();
+
+	VkBuffer ToHandle() {return fBuffer;}
+	area_id Area() {return fMemory.area;}
+	void *Address() {return fMemory.address;}
 };
 
 class VKLayerSurface: public VKLayerSurfaceBase {
 private:
 	LayerInstance *fInstance = NULL;
+	// Guards the fields below. The BitmapHook is set by the consumer while
+	// the swapchain presents, and swapchains of other surfaces never take it.
+	pthread_mutex_t fLock = PTHREAD_MUTEX_INITIALIZER;
 	VKLayerSwapchain *fSwapchain = NULL;
 	BitmapHook *fBitmapHook = NULL;
-
-	friend class VKLayerSwapchain;
+	uint32 fBitmapHookFlags = 0;
+	// Swapchain and readback buffer of each bitmap handed to a BitmapHook,
+	// the owner is NULL once it is destroyed. A retired swapchain and its
+	// replacement publish to the same hook, which may give either's bitmap
+	// back to the other.
+	struct BitmapOwner {
+		VKLayerSwapchain *swapchain;
+		int32 readbackIdx;
+	};
+	std::map<BBitmap*, BitmapOwner> fBitmapOwners;
 
 public:
 	VKLayerSurface();
@@ -189,6 +261,7 @@ public:
 	VkResult Init(LayerInstance *instance, const VkHeadlessSurfaceCreateInfoEXT &createInfo);
 
 	VkResult GetCapabilities(VkPhysicalDevice physDev, VkSurfaceCapabilitiesKHR *capabilities);
+	VkResult GetCapabilities2(VkPhysicalDevice physDev, const VkPhysicalDeviceSurfaceInfo2KHR *surfaceInfo, VkSurfaceCapabilities2KHR *capabilities);
 	VkResult GetFormats(VkPhysicalDevice physDev, uint32_t *count, VkSurfaceFormatKHR *formats);
 	VkResult GetPresentModes(VkPhysicalDevice physDev, uint32_t *count, VkPresentModeKHR *modes);
 	VkResult GetPresentRectangles(VkPhysicalDevice physDev, uint32_t* pRectCount, VkRect2D* pRects);
@@ -196,32 +269,216 @@ public:
 	static VKLayerSurface *FromHandle(VkSurfaceKHR surface) {return (VKLayerSurface*)surface;}
 	VkSurfaceKHR ToHandle() {return (VkSurfaceKHR)this;}
 
-	BitmapHook *GetBitmapHook() {return fBitmapHook;}
+	BitmapHook *GetBitmapHook();
+	BitmapHook *GetBitmapHook(uint32 &flags);
 	void SetBitmapHook(BitmapHook *hook) override;
+	void SetBitmapHookEtc(BitmapHook *hook, uint32 flags) override;
+
+	bool IsCurrentSwapchain(VKLayerSwapchain *swapchain);
+	// Makes swapchain the current one if oldSwapchain still is.
+	bool AttachSwapchain(VKLayerSwapchain *swapchain, VKLayerSwapchain *oldSwapchain);
+	void DetachSwapchain(VKLayerSwapchain *swapchain);
+
+	void AddBitmap(BBitmap *bitmap, VKLayerSwapchain *owner, int32 readbackIdx);
+	// Returns a bitmap the hook gave back to its owner, or deletes it if the
+	// owner is gone. Bitmaps the layer did not publish are left alone.
+	void ReleaseBitmap(BBitmap *bitmap);
+	// Passes ownership of the bitmaps of owner that a hook still holds to the
+	// layer, and returns their readback buffers.
+	void OrphanBitmaps(VKLayerSwapchain *owner, std::vector<int32> &readbackIdxs);
+};
+
+// Work of one swapchain in a present call. Layer_QueuePresentKHR() submits
+// the work of all swapchains of a call together.
+struct PresentSubmit {
+	uint32_t imageIdx = 0;
+	VkCommandBuffer cmd = VK_NULL_HANDLE;
+	VkSemaphore releaseSem = VK_NULL_HANDLE;
+	VkSemaphore chainSem = VK_NULL_HANDLE;
+	// One of the layer's queues, or the presenting queue.
+	VkQueue queue = VK_NULL_HANDLE;
+	bool fenced = false;
+	bool prepared = false;
+	SharedFence *fence = NULL;
+	VkResult result = VK_SUCCESS;
 };
 
 class VKLayerSwapchain {
 private:
+	// Partial readbacks are recorded per present, with this many blit
+	// regions at most. More complex damage is copied as its bounding box.
+	static constexpr int32 kMaxDamageRects = 32;
+	// Row pitch alignment of readback buffers and the bitmaps they are
+	// converted to, so that rows start on a cache line.
+	static constexpr size_t kRowAlignment = 64;
+
+	struct PresentRequest {
+		// Fence of the submission, shared with the other swapchains of the
+		// present call. Only set when the host needs to know when the present
+		// is done, otherwise fPresentThread hands the image back without
+		// waiting.
+		SharedFence *fence = NULL;
+		// Signaled by the present of the image, the next acquire of it waits
+		// for the present on the GPU instead.
+		VkSemaphore releaseSem = VK_NULL_HANDLE;
+		bool releasePending = false;
+		// Signaled by the first submission of a present call, for the
+		// submission of the same call on another queue to wait on.
+		VkSemaphore chainSem = VK_NULL_HANDLE;
+		int32 readbackIdx = -1;
+		BRegion damage;
+		uint64 presentId = 0;
+		VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+		// Zero copy: the present left the image in GENERAL layout for the host
+		// to read, the next acquire hands it back on the same layer queue.
+		VkQueue hostQueue = VK_NULL_HANDLE;
+		uint32_t hostFamily = UINT32_MAX;
+		// Nothing was submitted, the image is only given back to fImagePool.
+		bool released = false;
+	};
+
+	struct ReadbackBuffer {
+		// Either a linear image, or a buffer if fBufferReadback is set.
+		ObjectDeleter<VKLayerImage> image;
+		ObjectDeleter<VKLayerBuffer> hostBuffer;
+		ObjectDeleter<BBitmap> bitmap;
+		// Parts of the frame changed since this buffer was last filled.
+		BRegion stale;
+		// With CPU conversion, or if the image memory can not be shared, the
+		// image is converted or copied to bitmap when the frame is shown.
+		const uint8 *srcBits = NULL;
+		size_t srcStride = 0;
+		BRegion unconverted;
+	};
+
+	// Readback commands of one queue family.
+	struct ReadbackCommands {
+		VkCommandPool pool = VK_NULL_HANDLE;
+		// Recorded once for every swapchain image and readback buffer pair
+		// when first needed, a present only submits the matching one.
+		ArrayDeleter<VkCommandBuffer> copyCmds;
+		ArrayDeleter<bool> copyCmdRecorded;
+		// Partial readbacks, recorded per present of each image.
+		ArrayDeleter<VkCommandBuffer> damageCmds;
+		// Zero copy: return each image to PRESENT_SRC_KHR layout on acquire.
+		ArrayDeleter<VkCommandBuffer> returnCmds;
+		// Partial copies start at multiples of this.
+		VkExtent3D granularity{1, 1, 1};
+	};
+
 	LayerDevice *fDevice;
 	VKLayerSurface *fSurface;
 	VkExtent2D fImageExtent;
 	uint32 fImageCnt;
 	ArrayDeleter<VKLayerImage> fImages;
 	BufferQueue fImagePool;
-	ObjectDeleter<VKLayerImage> fBuffer;
-	VkCommandPool fCommandPool = VK_NULL_HANDLE;
-	VkQueue fQueue = VK_NULL_HANDLE;
-	VkFence fFence = VK_NULL_HANDLE;
+	// The application shares the images between queue families, the layer's
+	// queues were added to them. Exclusive images are read back by the family
+	// of the presenting queue, which owns them for the present.
+	bool fConcurrent = false;
+	bool fZeroCopy = false;
+	bool fDeferredAlloc = false;
+	// Formats with a matching color space are copied into the bitmaps, some
+	// other ones are copied and converted by the CPU, the rest is converted
+	// to B_RGB32 by a blit.
+	VkFormat fReadbackFormat = VK_FORMAT_B8G8R8A8_UNORM;
+	color_space fColorSpace = B_RGB32;
+	bool fCopyImage = false;
+	bool fConvert = false;
+	FormatConversion fConversion{};
+	// Copies that need no blit go to a buffer with rows of fReadbackRowPitch
+	// bytes, matching the bitmap that wraps or is filled from it.
+	bool fBufferReadback = false;
+	uint32 fReadbackPixelSize = 4;
+	size_t fReadbackRowPitch = 0;
+	// Blits need a graphics queue, copies run on the device's transfer queue.
+	bool fBlit = false;
+	VkPresentModeKHR fPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+
+	// Presented images are handed to fPresentThread, which waits for their
+	// readback and publishes them, so presents never block on the GPU.
+	ArrayDeleter<PresentRequest> fPresentRequests;
+	BufferQueue fPresentQueue;
+	thread_id fPresentThread = -1;
+
+	// Indexed by queue family, created on the first present read back there.
+	uint32 fCopyCmdCnt = 0;
+	uint32 fFamilyCnt = 0;
+	ArrayDeleter<ReadbackCommands> fReadbackCmds;
+
+	// Host visible readback targets, allocated on first use. Free ones are
+	// kept in fReadbackPool, one may be held by the BitmapHook until it hands
+	// it back from SetBitmap(). In zero copy mode there is one per swapchain
+	// image that only wraps its memory, and released images go back to
+	// fImagePool instead. The hook may hand them back to the present thread
+	// of another swapchain of the surface, so both pools have several
+	// producers.
+	uint32 fReadbackCnt = 0;
+	ArrayDeleter<ReadbackBuffer> fReadbackBuffers;
+	BufferQueue fReadbackPool;
+	int32 fPublishedIdx = -1;
+
+	// Buffers the presenting thread took out of fReadbackPool without using
+	// them, handed out before the pool is asked again.
+	uint32 fSpareReadbackCnt = 0;
+	ArrayDeleter<int32> fSpareReadbacks;
+
+	// Damage of the frames presented since the last publish, owned by
+	// fPresentThread.
+	BRegion fPublishDamage;
+	BitmapHook *fPublishHook = NULL;
+
+	// Compare finished frames with the published one on the CPU, to narrow
+	// the damage and drop frames that did not change at all.
+	static constexpr int32 kDamageTileSize = 64;
+	bool fDetectDamage = false;
+
+	// VK_KHR_present_wait: fPresentIdDone is the highest present id that was
+	// handed to the BitmapHook or dropped in favour of a newer frame.
+	std::atomic<uint64> fLastPresentId{0};
+	uint64 fPresentIdDone = 0;
+	// Replaced by a newer swapchain of the surface. Guarded by fPresentIdLock
+	// like the present ids that waiters check along with it.
 	bool fRetired = false;
-
-	ObjectDeleter<BBitmap> fBitmap;
-	AreaDeleter fBitmapArea;
-	BBitmap *fCurBitmap;
-
-	VkImageCreateInfo ImageFromCreateInfo(const VkSwapchainCreateInfoKHR &createInfo);
-	VkResult CreateBuffer();
-	VkResult CopyToBuffer(VkImage srcImage, int32_t width, int32_t height);
+	pthread_mutex_t fPresentIdLock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t fPresentIdCond = PTHREAD_COND_INITIALIZER;
+
+	bool CanZeroCopy(const VkSwapchainCreateInfoKHR &createInfo);
+	void SelectReadbackFormat(VkFormat format);
+	VkImageCreateInfo ImageFromCreateInfo(const VkSwapchainCreateInfoKHR &createInfo, std::vector<uint32_t> &queueFamilies);
+	VkResult CreateBitmap(ReadbackBuffer &buffer, VKLayerImage &image);
+	VkResult CreateBitmap(ReadbackBuffer &buffer, VKLayerBuffer &hostBuffer);
+	VkResult CreateBitmapEtc(ReadbackBuffer &buffer, area_id area, void *address, size_t offset, size_t rowPitch);
+	VkResult CreateReadbackBuffers();
+	VkResult InitReadbackBuffer(int32 readbackIdx);
+	void FreeReadbackBuffer(int32 readbackIdx);
+	void ReleaseIdleBuffers();
+	VkResult CreatePresentRequests();
+	VkResult InitReadbackCommands(uint32_t family);
+	void FreeReadbackCommands(ReadbackCommands &cmds);
+	VkResult CopyCmd(uint32 imageIdx, int32 readbackIdx, uint32_t family, VkCommandBuffer &copyCmd);
+	void AlignCopyRect(clipping_rect &rect, const VkExtent3D &granularity);
+	VkResult CopyToBuffer(VkCommandBuffer copyCmd, VkImage srcImage, ReadbackBuffer &dst, const BRegion *damage = NULL, const VkExtent3D &granularity = {1, 1, 1});
+	VkResult MakeHostVisible(VkCommandBuffer cmd, VkImage image);
+	VkResult ReturnFromHost(VkCommandBuffer cmd, VkImage image);
+	VkQueue ReadbackQueue(VkQueue presentQueue, uint32_t &family);
 	VkResult CheckSuboptimal();
+	BRect FrameRect() {return BRect(0, 0, fImageExtent.width - 1, fImageExtent.height - 1);}
+	VKLayerImage &ReadbackImage(int32 readbackIdx) {return fZeroCopy ? fImages[readbackIdx] : *fReadbackBuffers[readbackIdx].image.Get();}
+	VkResult InvalidateReadback(int32 readbackIdx);
+	void DisableReadbackRecycle(int32 readbackIdx);
+	void GetPresentDamage(const VkPresentInfoKHR *presentInfo, uint32_t idx, BRegion &damage);
+	VkResult PrepareReadback(PresentRequest &request, uint32 imageIdx, uint32_t family, VkCommandBuffer &copyCmd);
+	void ConvertBuffer(int32 readbackIdx);
+	bool DetectDamage(int32 readbackIdx);
+	void Publish(int32 readbackIdx);
+	void ReclaimBitmaps();
+	void ReleaseBuffer(int32 readbackIdx);
+	void CompletePresent(uint64 presentId);
+	void Retire();
+
+	static status_t PresentThreadEntry(void *arg);
+	void PresentThread();
 
 public:
 	VKLayerSwapchain();
@@ -230,36 +487,60 @@ public:
 
 	VkResult GetSwapchainImages(uint32_t *count, VkImage *images);
 	VkResult AcquireNextImage(const VkAcquireNextImageInfoKHR *pAcquireInfo, uint32_t *pImageIndex);
-	VkResult QueuePresent(VkQueue queue, const VkPresentInfoKHR *present_info, uint32_t idx);
+	VkResult PreparePresent(VkQueue queue, const VkPresentInfoKHR *presentInfo, uint32_t idx, PresentSubmit &submit);
+	VkResult FinishPresent(const VkPresentInfoKHR *presentInfo, uint32_t idx, PresentSubmit &submit);
+	VkResult WaitForPresent(uint64_t presentId, uint64_t timeout);
+	VkResult ReleaseImages(const VkReleaseSwapchainImagesInfoEXT *releaseInfo);
+	// Called by the surface with its lock held, from the present thread of
+	// any swapchain publishing to the same hook.
+	void ReleaseBitmap(int32 readbackIdx);
 
 	static VKLayerSwapchain *FromHandle(VkSwapchainKHR surface) {return (VKLayerSwapchain*)surface;}
 	VkSwapchainKHR ToHandle() {return (VkSwapchainKHR)this;}
+	LayerDevice *GetDevice() {return fDevice;}
 };
 
 
 //#pragma mark - VKLayerImage
 
 VKLayerImage::VKLayerImage():
-	fDevice(NULL), fImage(0), fMemory(0)
+	fDevice(NULL), fImage(0), fCpuMem(false), fHostArea(false), fCoherent(true), fRecycle(true)
 {}
 
 VKLayerImage::~VKLayerImage()
 {
+	if (fDevice == NULL)
+		return;
 	fDevice->Hooks().DestroyImage(fDevice->ToHandle(), fImage, NULL);
-	fDevice->Hooks().FreeMemory(fDevice->ToHandle(), fMemory, NULL);
+	if (fRecycle)
+		fDevice->GetMemoryPool().Recycle(fMemory);
+	else
+		fDevice->GetMemoryPool().Discard(fMemory);
 }
 
-VkResult VKLayerImage::Init(LayerDevice *device, const VkImageCreateInfo &createInfo, bool cpuMem, area_id *area)
+VkResult VKLayerImage::Init(LayerDevice *device, const VkImageCreateInfo &createInfo, bool cpuMem, bool hostArea, bool deferAlloc)
 {
 	fDevice = device;
+	fCpuMem = cpuMem;
+	fHostArea = hostArea;
 
 	VkCheckRet(fDevice->Hooks().CreateImage(fDevice->ToHandle(), &createInfo, NULL, &fImage));
 
+	if (deferAlloc)
+		return VK_SUCCESS;
+	return Allocate();
+}
+
+VkResult VKLayerImage::Allocate()
+{
 	VkMemoryRequirements memRequirements;
 	fDevice->Hooks().GetImageMemoryRequirements(fDevice->ToHandle(), fImage, &memRequirements);
 	size_t memTypeIdx = 0;
-	if (cpuMem) {
-		memTypeIdx = getMemoryTypeIndex(fDevice, memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	if (fCpuMem) {
+		memTypeIdx = getReadbackMemoryTypeIndex(fDevice, memRequirements.memoryTypeBits, fHostArea);
+		if (memTypeIdx == UINT32_MAX)
+			return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+		fCoherent = isMemoryTypeCoherent(fDevice, memTypeIdx);
 	} else {
 		for (; memTypeIdx < 8 * sizeof(memRequirements.memoryTypeBits); ++memTypeIdx) {
 			if (memRequirements.memoryTypeBits & (1u << memTypeIdx))
@@ -268,37 +549,80 @@ VkResult VKLayerImage::Init(LayerDevice *device, const VkImageCreateInfo &create
 		assert(memTypeIdx <= 8 * sizeof(memRequirements.memoryTypeBits) - 1);
 	}
 
-	VkMemoryAllocateInfo memAllocInfo{
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = memRequirements.size,
-		.memoryTypeIndex = (uint32_t)memTypeIdx
+	VkCheckRet(fDevice->GetMemoryPool().Alloc(memRequirements.size, (uint32_t)memTypeIdx, fHostArea, fMemory));
+	VkCheckRet(fDevice->Hooks().BindImageMemory(fDevice->ToHandle(), fImage, fMemory.memory, 0));
+
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerImage::InvalidateHostCache()
+{
+	if (fCoherent)
+		return VK_SUCCESS;
+	return invalidateMemory(fDevice, fMemory.memory);
+}
+
+
+//#pragma mark - VKLayerBuffer
+
+VKLayerBuffer::VKLayerBuffer():
+	fDevice(NULL), fBuffer(VK_NULL_HANDLE), fCoherent(true), fRecycle(true)
+{}
+
+VKLayerBuffer::~VKLayerBuffer()
+{
+	if (fDevice == NULL)
+		return;
+	fDevice->Hooks().DestroyBuffer(fDevice->ToHandle(), fBuffer, NULL);
+	if (fRecycle)
+		fDevice->GetMemoryPool().Recycle(fMemory);
+	else
+		fDevice->GetMemoryPool().Discard(fMemory);
+}
+
+VkResult VKLayerBuffer::Init(LayerDevice *device, VkDeviceSize size)
+{
+	fDevice = device;
+
+	// Only written by the layer's transfer queue.
+	VkBufferCreateInfo createInfo{
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = size,
+		.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE
 	};
+	VkCheckRet(fDevice->Hooks().CreateBuffer(fDevice->ToHandle(), &createInfo, NULL, &fBuffer));
 
-	VkImportMemoryHostPointerInfoEXT hostPtrInfo;
-	AreaDeleter memArea;
-	if (area != NULL) {
-		void *memAreaAdr = NULL;
-		memArea.SetTo(create_area("WSI image", &memAreaAdr, B_ANY_ADDRESS, memRequirements.size, B_FULL_LOCK, B_READ_AREA | B_WRITE_AREA | B_CLONEABLE_AREA));
-		if (!memArea.IsSet())
-			return VK_ERROR_OUT_OF_HOST_MEMORY;
-		hostPtrInfo = {
-			.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT,
-			.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
-			.pHostPointer = memAreaAdr
-		};
-		memAllocInfo.pNext = &hostPtrInfo;
-	}
+	VkMemoryRequirements memRequirements;
+	fDevice->Hooks().GetBufferMemoryRequirements(fDevice->ToHandle(), fBuffer, &memRequirements);
+	uint32_t memTypeIdx = getReadbackMemoryTypeIndex(fDevice, memRequirements.memoryTypeBits, true);
+	if (memTypeIdx == UINT32_MAX)
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	fCoherent = isMemoryTypeCoherent(fDevice, memTypeIdx);
 
-	VkCheckRet(fDevice->Hooks().AllocateMemory(fDevice->ToHandle(), &memAllocInfo, nullptr, &fMemory));
-	VkCheckRet(fDevice->Hooks().BindImageMemory(fDevice->ToHandle(), fImage, fMemory, 0));
+	VkCheckRet(fDevice->GetMemoryPool().Alloc(memRequirements.size, memTypeIdx, true, fMemory));
+	VkCheckRet(fDevice->Hooks().BindBufferMemory(fDevice->ToHandle(), fBuffer, fMemory.memory, 0));
 
-	if (area != NULL) {*area = memArea.Detach();}
 	return VK_SUCCESS;
 }
 
+VkResult VKLayerBuffer::InvalidateHostCache()
+{
+	if (fCoherent)
+		return VK_SUCCESS;
+	return invalidateMemory(fDevice, fMemory.memory);
+}
+
 
 //#pragma mark - VKLayerSurface
 
+static const VkPresentModeKHR sPresentModes[] = {VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR, VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR};
+
+static bool IsPresentModeSupported(VkPresentModeKHR mode)
+{
+	return std::find(std::begin(sPresentModes), std::end(sPresentModes), mode) != std::end(sPresentModes);
+}
+
 VKLayerSurface::VKLayerSurface()
 {}
 
@@ -319,18 +643,18 @@ VkResult VKLayerSurface::GetCapabilities(VkPhysicalDevice physDev, VkSurfaceCapa
 	surfaceCapabilities->maxImageCount = 3;
 
 	/* Surface extents */
-	if (fBitmapHook != NULL)
-		fBitmapHook->GetSize(surfaceCapabilities->currentExtent.width, surfaceCapabilities->currentExtent.height);
+	BitmapHook *bitmapHook = GetBitmapHook();
+	if (bitmapHook != NULL)
+		bitmapHook->GetSize(surfaceCapabilities->currentExtent.width, surfaceCapabilities->currentExtent.height);
 	else
 		surfaceCapabilities->currentExtent = {(uint32_t)-1, (uint32_t)-1};
 
 	surfaceCapabilities->minImageExtent = {1, 1};
 	/* Ask the device for max */
-	VkPhysicalDeviceProperties devProps;
-	fInstance->Hooks().GetPhysicalDeviceProperties(physDev, &devProps);
+	const VkPhysicalDeviceLimits &limits = fInstance->GetPhysDevInfo(physDev).properties.limits;
 
 	surfaceCapabilities->maxImageExtent = {
-		devProps.limits.maxImageDimension2D, devProps.limits.maxImageDimension2D
+		limits.maxImageDimension2D, limits.maxImageDimension2D
 	};
 	surfaceCapabilities->maxImageArrayLayers = 1;
 
@@ -352,34 +676,55 @@ VkResult VKLayerSurface::GetCapabilities(VkPhysicalDevice physDev, VkSurfaceCapa
 	return VK_SUCCESS;
 }
 
-VkResult VKLayerSurface::GetFormats(VkPhysicalDevice physDev, uint32_t *count, VkSurfaceFormatKHR *surfaceFormats)
+VkResult VKLayerSurface::GetCapabilities2(VkPhysicalDevice physDev, const VkPhysicalDeviceSurfaceInfo2KHR *surfaceInfo, VkSurfaceCapabilities2KHR *capabilities)
 {
-/*
-	VkFormat formats[] = {VK_FORMAT_B8G8R8A8_UNORM};
-	uint32_t formatCnt = 1;
-*/
-	constexpr int max_core_1_0_formats = VK_FORMAT_ASTC_12x12_SRGB_BLOCK + 1;
-	VkFormat formats[max_core_1_0_formats];
-	uint32_t formatCnt = 0;
-	
-	for (int format = 0; format < max_core_1_0_formats; format++) {
-		VkImageFormatProperties formatProps;
-		VkResult res = fInstance->Hooks().GetPhysicalDeviceImageFormatProperties(
-			physDev, (VkFormat)format, VK_IMAGE_TYPE_2D,
-			VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT,
-			&formatProps
-		);
-		if (res != VK_ERROR_FORMAT_NOT_SUPPORTED) {
-			formats[formatCnt++] = (VkFormat)format;
+	VkCheckRet(GetCapabilities(physDev, &capabilities->surfaceCapabilities));
+
+	// VK_EXT_surface_maintenance1, the queried present mode does not change anything.
+	(void)surfaceInfo;
+	for (auto *item = (VkBaseOutStructure*)capabilities->pNext; item != NULL; item = item->pNext) {
+		switch (item->sType) {
+			case VK_STRUCTURE_TYPE_SURFACE_PRESENT_SCALING_CAPABILITIES_EXT: {
+				auto scaling = (VkSurfacePresentScalingCapabilitiesEXT*)item;
+				scaling->supportedPresentScaling = 0;
+				scaling->supportedPresentGravityX = 0;
+				scaling->supportedPresentGravityY = 0;
+				scaling->minScaledImageExtent = capabilities->surfaceCapabilities.minImageExtent;
+				scaling->maxScaledImageExtent = capabilities->surfaceCapabilities.maxImageExtent;
+				break;
+			}
+			case VK_STRUCTURE_TYPE_SURFACE_PRESENT_MODE_COMPATIBILITY_EXT: {
+				auto compatibility = (VkSurfacePresentModeCompatibilityEXT*)item;
+				if (compatibility->pPresentModes == NULL) {
+					compatibility->presentModeCount = B_COUNT_OF(sPresentModes);
+					break;
+				}
+				compatibility->presentModeCount = std::min<uint32_t>(compatibility->presentModeCount, B_COUNT_OF(sPresentModes));
+				memcpy(compatibility->pPresentModes, sPresentModes, sizeof(VkPresentModeKHR)*compatibility->presentModeCount);
+				break;
+			}
+			default:
+				break;
 		}
 	}
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSurface::GetFormats(VkPhysicalDevice physDev, uint32_t *count, VkSurfaceFormatKHR *surfaceFormats)
+{
+	const std::vector<VkFormat> &formats = fInstance->GetPhysDevInfo(physDev).surfaceFormats;
+	uint32_t formatCnt = formats.size();
 
 	if (surfaceFormats == NULL) {
 		*count = formatCnt;
 		return VK_SUCCESS;
 	}
-	memcpy(surfaceFormats, formats, sizeof(VkFormat)*std::min<uint32_t>(*count, formatCnt));
-	if (*count < formatCnt)
+	uint32_t copyCnt = std::min<uint32_t>(*count, formatCnt);
+	for (uint32_t i = 0; i < copyCnt; i++) {
+		surfaceFormats[i] = {formats[i], VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+	}
+	*count = copyCnt;
+	if (copyCnt < formatCnt)
 		return VK_INCOMPLETE;
 	return VK_SUCCESS;
 }
@@ -387,13 +732,12 @@ VkResult VKLayerSurface::GetFormats(VkPhysicalDevice physDev, uint32_t *count, V
 VkResult VKLayerSurface::GetPresentModes(VkPhysicalDevice physDev, uint32_t *count, VkPresentModeKHR *presentModes)
 {
 	(void)physDev;
-	static const VkPresentModeKHR modes[] = {VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR};
 	if (presentModes == NULL) {
-		*count = B_COUNT_OF(modes);
+		*count = B_COUNT_OF(sPresentModes);
 		return VK_SUCCESS;
 	}
-	memcpy(presentModes, modes, sizeof(VkPresentModeKHR)*std::min<uint32_t>(*count, B_COUNT_OF(modes)));
-	if (*count < B_COUNT_OF(modes))
+	memcpy(presentModes, sPresentModes, sizeof(VkPresentModeKHR)*std::min<uint32_t>(*count, B_COUNT_OF(sPresentModes)));
+	if (*count < B_COUNT_OF(sPresentModes))
 		return VK_INCOMPLETE;
 	return VK_SUCCESS;
 }
@@ -417,7 +761,87 @@ VkResult VKLayerSurface::GetPresentRectangles(VkPhysicalDevice physDev, uint32_t
 
 void VKLayerSurface::SetBitmapHook(BitmapHook *hook)
 {
+	SetBitmapHookEtc(hook, 0);
+}
+
+BitmapHook *VKLayerSurface::GetBitmapHook()
+{
+	PthreadMutexLocker lock(&fLock);
+	return fBitmapHook;
+}
+
+BitmapHook *VKLayerSurface::GetBitmapHook(uint32 &flags)
+{
+	PthreadMutexLocker lock(&fLock);
+	flags = fBitmapHookFlags;
+	return fBitmapHook;
+}
+
+void VKLayerSurface::SetBitmapHookEtc(BitmapHook *hook, uint32 flags)
+{
+	PthreadMutexLocker lock(&fLock);
 	fBitmapHook = hook;
+	fBitmapHookFlags = flags;
+}
+
+bool VKLayerSurface::IsCurrentSwapchain(VKLayerSwapchain *swapchain)
+{
+	PthreadMutexLocker lock(&fLock);
+	return fSwapchain == swapchain;
+}
+
+bool VKLayerSurface::AttachSwapchain(VKLayerSwapchain *swapchain, VKLayerSwapchain *oldSwapchain)
+{
+	PthreadMutexLocker lock(&fLock);
+	if (oldSwapchain != NULL && fSwapchain != oldSwapchain)
+		return false;
+	fSwapchain = swapchain;
+	return true;
+}
+
+void VKLayerSurface::DetachSwapchain(VKLayerSwapchain *swapchain)
+{
+	// A retired swapchain, or one that failed to initialize, must not
+	// detach the current one.
+	PthreadMutexLocker lock(&fLock);
+	if (fSwapchain == swapchain)
+		fSwapchain = NULL;
+}
+
+void VKLayerSurface::AddBitmap(BBitmap *bitmap, VKLayerSwapchain *owner, int32 readbackIdx)
+{
+	PthreadMutexLocker lock(&fLock);
+	fBitmapOwners[bitmap] = {owner, readbackIdx};
+}
+
+void VKLayerSurface::ReleaseBitmap(BBitmap *bitmap)
+{
+	if (bitmap == NULL)
+		return;
+
+	// The owner can not be destroyed while the lock is held, see
+	// OrphanBitmap().
+	PthreadMutexLocker lock(&fLock);
+	auto it = fBitmapOwners.find(bitmap);
+	if (it == fBitmapOwners.end())
+		return;
+	BitmapOwner owner = it->second;
+	fBitmapOwners.erase(it);
+	if (owner.swapchain != NULL)
+		owner.swapchain->ReleaseBitmap(owner.readbackIdx);
+	else
+		delete bitmap;
+}
+
+void VKLayerSurface::OrphanBitmaps(VKLayerSwapchain *owner, std::vector<int32> &readbackIdxs)
+{
+	PthreadMutexLocker lock(&fLock);
+	for (auto &it: fBitmapOwners) {
+		if (it.second.swapchain != owner)
+			continue;
+		it.second.swapchain = NULL;
+		readbackIdxs.push_back(it.second.readbackIdx);
+	}
 }
 
 
@@ -428,20 +852,146 @@ VKLayerSwapchain::VKLayerSwapchain()
 
 VKLayerSwapchain::~VKLayerSwapchain()
 {
-	if (fCommandPool != VK_NULL_HANDLE) {
-		fDevice->Hooks().DestroyCommandPool(fDevice->ToHandle(), fCommandPool, nullptr);
-		fDevice->Hooks().QueueWaitIdle(fQueue);
+	if (fPresentThread >= 0) {
+		// Pending presents are still drained before the quit request is seen.
+		fPresentQueue.Add(-1);
+		status_t res;
+		wait_for_thread(fPresentThread, &res);
+	}
+
+	if (fPresentRequests.IsSet()) {
+		// Release semaphores must not be destroyed with a signal pending.
+		for (uint32_t i = 0; i < fImageCnt; i++) {
+			PresentRequest &request = fPresentRequests[i];
+			if (request.releasePending) {
+				VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+				VkSubmitInfo submit{
+					.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+					.waitSemaphoreCount = 1,
+					.pWaitSemaphores = &request.releaseSem,
+					.pWaitDstStageMask = &waitStage
+				};
+				if (fDevice->SubmitTransfer(1, &submit, VK_NULL_HANDLE) == VK_SUCCESS)
+					request.releasePending = false;
+			}
+		}
+		fDevice->WaitTransferIdle();
+		for (uint32_t i = 0; i < fImageCnt; i++) {
+			fDevice->Hooks().DestroySemaphore(fDevice->ToHandle(), fPresentRequests[i].releaseSem, NULL);
+			fDevice->Hooks().DestroySemaphore(fDevice->ToHandle(), fPresentRequests[i].chainSem, NULL);
+		}
+	}
+
+	// Submissions on application queues are fenced, fPresentThread waited
+	// for them.
+	if (fReadbackCmds.IsSet()) {
+		fDevice->WaitTransferIdle();
+		for (uint32_t i = 0; i < fFamilyCnt; i++)
+			FreeReadbackCommands(fReadbackCmds[i]);
+	}
+
+	// Bitmaps the BitmapHook still holds are deleted when it gives them back,
+	// so their memory must not be handed to another swapchain.
+	std::vector<int32> readbackIdxs;
+	fSurface->OrphanBitmaps(this, readbackIdxs);
+	for (int32 readbackIdx: readbackIdxs) {
+		fReadbackBuffers[readbackIdx].bitmap.Detach();
+		DisableReadbackRecycle(readbackIdx);
+	}
+
+	fSurface->DetachSwapchain(this);
+}
+
+bool VKLayerSwapchain::CanZeroCopy(const VkSwapchainCreateInfoKHR &createInfo)
+{
+	const char *zeroCopy = getenv("VIDEOSTREAMS_WSI_ZERO_COPY");
+	if (zeroCopy == NULL || strcmp(zeroCopy, "1") != 0)
+		return false;
+
+	// The image memory is handed out as a B_RGB32 bitmap as is, which needs
+	// it to be imported from an area.
+	if (fDevice->GetHostImportTypeBits() == 0)
+		return false;
+	// Images the host reads are returned to the application on acquire,
+	// which needs a queue of the layer's own.
+	if (fDevice->GetTransferQueue() == VK_NULL_HANDLE)
+		return false;
+	if (!(createInfo.imageFormat == VK_FORMAT_B8G8R8A8_UNORM || createInfo.imageFormat == VK_FORMAT_B8G8R8A8_SRGB))
+		return false;
+	if (createInfo.imageArrayLayers != 1)
+		return false;
+
+	VkImageFormatProperties formatProps;
+	VkResult res = fDevice->GetInstance()->Hooks().GetPhysicalDeviceImageFormatProperties(
+		fDevice->GetPhysDev(), createInfo.imageFormat, VK_IMAGE_TYPE_2D,
+		VK_IMAGE_TILING_LINEAR, createInfo.imageUsage, 0,
+		&formatProps
+	);
+	if (res != VK_SUCCESS)
+		return false;
+
+	return createInfo.imageExtent.width <= formatProps.maxExtent.width && createInfo.imageExtent.height <= formatProps.maxExtent.height;
+}
+
+void VKLayerSwapchain::SelectReadbackFormat(VkFormat format)
+{
+	// Copies go to buffers, which take any format, unless linear images are
+	// asked for to compare both.
+	const char *linearReadback = getenv("VIDEOSTREAMS_WSI_LINEAR_READBACK");
+	bool linear = fZeroCopy || (linearReadback != NULL && strcmp(linearReadback, "1") == 0);
+
+	// Readback images in the swapchain format are linear copy destinations.
+	if (linear) {
+		VkImageFormatProperties formatProps;
+		VkResult res = fDevice->GetInstance()->Hooks().GetPhysicalDeviceImageFormatProperties(
+			fDevice->GetPhysDev(), format, VK_IMAGE_TYPE_2D,
+			VK_IMAGE_TILING_LINEAR, VK_IMAGE_USAGE_TRANSFER_DST_BIT, 0,
+			&formatProps
+		);
+		if (res != VK_SUCCESS || fImageExtent.width > formatProps.maxExtent.width || fImageExtent.height > formatProps.maxExtent.height)
+			return;
 	}
 
-	fDevice->Hooks().DestroyFence(fDevice->ToHandle(), fFence, NULL);
+	// sRGB variants have the same bytes, the consumer does no color management.
+	color_space colorSpace = NativeColorSpace(format);
+	if (colorSpace != B_NO_COLOR_SPACE) {
+		fReadbackFormat = format;
+		fColorSpace = colorSpace;
+		fCopyImage = true;
+	} else if (FindRgb32Conversion(format, fConversion)) {
+		fReadbackFormat = format;
+		fCopyImage = true;
+		fConvert = true;
+	}
 
-	if (!fRetired) {
-		fSurface->fSwapchain = NULL;
+	fBufferReadback = fCopyImage && !linear;
+	if (fBufferReadback) {
+		if (fConvert) {
+			fReadbackPixelSize = fConversion.srcPixelSize;
+		} else {
+			size_t pixelSize = 4;
+			get_pixel_size_for(fColorSpace, &pixelSize, NULL, NULL);
+			fReadbackPixelSize = pixelSize;
+		}
+		size_t rowSize = (size_t)fImageExtent.width * fReadbackPixelSize;
+		fReadbackRowPitch = (rowSize + kRowAlignment - 1) / kRowAlignment * kRowAlignment;
 	}
 }
 
-VkImageCreateInfo VKLayerSwapchain::ImageFromCreateInfo(const VkSwapchainCreateInfoKHR &createInfo)
+VkImageCreateInfo VKLayerSwapchain::ImageFromCreateInfo(const VkSwapchainCreateInfoKHR &createInfo, std::vector<uint32_t> &queueFamilies)
 {
+	// Images the application shares anyway are shared with the family of
+	// the layer's readback queue as well. Exclusive ones keep their mode, as
+	// it may enable compression and the application transfers ownership.
+	fConcurrent = createInfo.imageSharingMode == VK_SHARING_MODE_CONCURRENT;
+	queueFamilies.clear();
+	if (fConcurrent) {
+		queueFamilies.assign(createInfo.pQueueFamilyIndices, createInfo.pQueueFamilyIndices + createInfo.queueFamilyIndexCount);
+		uint32_t family = fBlit ? fDevice->GetBlitFamily() : fDevice->GetTransferFamily();
+		if (family != UINT32_MAX && std::find(queueFamilies.begin(), queueFamilies.end(), family) == queueFamilies.end())
+			queueFamilies.push_back(family);
+	}
+
 	return VkImageCreateInfo{
 		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
 		.pNext = nullptr,
@@ -455,132 +1005,581 @@ VkImageCreateInfo VKLayerSwapchain::ImageFromCreateInfo(const VkSwapchainCreateI
 		.mipLevels = 1,
 		.arrayLayers = createInfo.imageArrayLayers,
 		.samples = VK_SAMPLE_COUNT_1_BIT,
-		.tiling = VK_IMAGE_TILING_OPTIMAL,
+		.tiling = fZeroCopy ? VK_IMAGE_TILING_LINEAR : VK_IMAGE_TILING_OPTIMAL,
 		.usage = createInfo.imageUsage,
 		.sharingMode = createInfo.imageSharingMode,
-		.queueFamilyIndexCount = createInfo.queueFamilyIndexCount,
-		.pQueueFamilyIndices = createInfo.pQueueFamilyIndices,
+		.queueFamilyIndexCount = (uint32_t)queueFamilies.size(),
+		.pQueueFamilyIndices = fConcurrent ? queueFamilies.data() : NULL,
 		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
 	};
 }
 
-VkResult VKLayerSwapchain::CreateBuffer()
+VkResult VKLayerSwapchain::CreateBitmap(ReadbackBuffer &buffer, VKLayerImage &image)
 {
-	VkCommandPoolCreateInfo cmdPoolInfo{
-		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-		.queueFamilyIndex = 0
-	};
-	VkCheckRet(fDevice->Hooks().CreateCommandPool(fDevice->ToHandle(), &cmdPoolInfo, nullptr, &fCommandPool));
+	VkImageSubresource subResource{.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT};
+	VkSubresourceLayout subResourceLayout;
+	fDevice->Hooks().GetImageSubresourceLayout(fDevice->ToHandle(), image.ToHandle(), &subResource, &subResourceLayout);
+	return CreateBitmapEtc(buffer, image.Area(), image.Address(), subResourceLayout.offset, subResourceLayout.rowPitch);
+}
 
-	VkImageCreateInfo createInfo{
-		.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-		.imageType = VK_IMAGE_TYPE_2D,
-		.format = VK_FORMAT_B8G8R8A8_UNORM,
-		.extent = {
-			.width = fImageExtent.width,
-			.height = fImageExtent.height,
-			.depth = 1
-		},
-		.mipLevels = 1,
-		.arrayLayers = 1,
-		.samples = VK_SAMPLE_COUNT_1_BIT,
-		.tiling = VK_IMAGE_TILING_LINEAR,
-		.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
-	};
-	fBuffer.SetTo(new(std::nothrow) VKLayerImage());
-	if (!fBuffer.IsSet())
+VkResult VKLayerSwapchain::CreateBitmap(ReadbackBuffer &buffer, VKLayerBuffer &hostBuffer)
+{
+	return CreateBitmapEtc(buffer, hostBuffer.Area(), hostBuffer.Address(), 0, fReadbackRowPitch);
+}
+
+VkResult VKLayerSwapchain::CreateBitmapEtc(ReadbackBuffer &buffer, area_id area, void *address, size_t offset, size_t rowPitch)
+{
+	if (!fConvert) {
+		// Memory that was not imported is mapped, which can be shared if the
+		// mapping is an area of its own.
+		size_t areaOffset = offset;
+		area_info areaInfo;
+		if (area < 0 && address != NULL) {
+			area = area_for(address);
+			if (area >= 0 && get_area_info(area, &areaInfo) == B_OK)
+				areaOffset += (uint8*)address - (uint8*)areaInfo.address;
+			else
+				area = -1;
+		}
+		if (area >= 0) {
+			buffer.bitmap.SetTo(new(std::nothrow) BBitmap(area, areaOffset, FrameRect(), B_BITMAP_IS_AREA, fColorSpace, rowPitch));
+			if (buffer.bitmap.IsSet() && buffer.bitmap->IsValid())
+				return VK_SUCCESS;
+		}
+		if (fZeroCopy)
+			return VK_ERROR_OUT_OF_HOST_MEMORY;
+	}
+
+	// Converted frames, and frames in memory that can not be shared, are
+	// copied to a bitmap of their own when they are shown.
+	if (address == NULL)
+		return VK_ERROR_MEMORY_MAP_FAILED;
+	buffer.srcBits = (const uint8*)address + offset;
+	buffer.srcStride = rowPitch;
+	color_space colorSpace = fConvert ? B_RGB32 : fColorSpace;
+	int32 bytesPerRow = B_ANY_BYTES_PER_ROW;
+	if (fBufferReadback) {
+		size_t pixelSize = 4;
+		get_pixel_size_for(colorSpace, &pixelSize, NULL, NULL);
+		size_t rowSize = (size_t)fImageExtent.width * pixelSize;
+		bytesPerRow = (rowSize + kRowAlignment - 1) / kRowAlignment * kRowAlignment;
+	}
+	buffer.bitmap.SetTo(new(std::nothrow) BBitmap(FrameRect(), 0, colorSpace, bytesPerRow));
+	if (!buffer.bitmap.IsSet() || !buffer.bitmap->IsValid())
 		return VK_ERROR_OUT_OF_HOST_MEMORY;
-	area_id area;
-	VkCheckRet(fBuffer->Init(fDevice, createInfo, true, &area));
-	fBitmapArea.SetTo(area);
 
-	VkImageSubresource subResource{.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT};
-	VkSubresourceLayout subResourceLayout;
-	fDevice->Hooks().GetImageSubresourceLayout(fDevice->ToHandle(), fBuffer->ToHandle(), &subResource, &subResourceLayout);
-	fBitmap.SetTo(new(std::nothrow) BBitmap(fBitmapArea.Get(), 0, BRect(0, 0, fImageExtent.width - 1, fImageExtent.height - 1), B_BITMAP_IS_AREA, B_RGB32, subResourceLayout.rowPitch));
-	if (!fBitmap.IsSet())
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSwapchain::CreateReadbackBuffers()
+{
+	// Every swapchain image can be in flight while the BitmapHook still shows
+	// an older frame, so presents never have to wait for the consumer.
+	fReadbackCnt = fImageCnt + 1;
+	fReadbackBuffers.SetTo(new(std::nothrow) ReadbackBuffer[fReadbackCnt]);
+	if (!fReadbackBuffers.IsSet())
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	fSpareReadbacks.SetTo(new(std::nothrow) int32[fReadbackCnt]);
+	if (!fSpareReadbacks.IsSet())
 		return VK_ERROR_OUT_OF_HOST_MEMORY;
-	fCurBitmap = fBitmap.Get();
+	if (!fReadbackPool.SetMaxLen(fReadbackCnt, true))
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+	for (uint32_t i = 0; i < fReadbackCnt; i++)
+		fReadbackPool.Add(i);
+
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSwapchain::InitReadbackBuffer(int32 readbackIdx)
+{
+	// A buffer whose bitmap was left to a replaced hook still has its memory
+	// and copy commands, see ReclaimBitmaps().
+	FreeReadbackBuffer(readbackIdx);
+
+	ReadbackBuffer &buffer = fReadbackBuffers[readbackIdx];
+	VkResult res;
+	if (fBufferReadback) {
+		buffer.hostBuffer.SetTo(new(std::nothrow) VKLayerBuffer());
+		if (!buffer.hostBuffer.IsSet())
+			return VK_ERROR_OUT_OF_HOST_MEMORY;
+		res = buffer.hostBuffer->Init(fDevice, (VkDeviceSize)fReadbackRowPitch * fImageExtent.height);
+		if (res == VK_SUCCESS)
+			res = CreateBitmap(buffer, *buffer.hostBuffer.Get());
+	} else {
+		VkImageCreateInfo createInfo{
+			.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+			.imageType = VK_IMAGE_TYPE_2D,
+			.format = fReadbackFormat,
+			.extent = {
+				.width = fImageExtent.width,
+				.height = fImageExtent.height,
+				.depth = 1
+			},
+			.mipLevels = 1,
+			.arrayLayers = 1,
+			.samples = VK_SAMPLE_COUNT_1_BIT,
+			.tiling = VK_IMAGE_TILING_LINEAR,
+			.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+			.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+		};
+
+		buffer.image.SetTo(new(std::nothrow) VKLayerImage());
+		if (!buffer.image.IsSet())
+			return VK_ERROR_OUT_OF_HOST_MEMORY;
+		res = buffer.image->Init(fDevice, createInfo, true, true);
+		if (res == VK_SUCCESS)
+			res = CreateBitmap(buffer, *buffer.image.Get());
+	}
+	if (res != VK_SUCCESS) {
+		FreeReadbackBuffer(readbackIdx);
+		return res;
+	}
+	buffer.stale.Set(FrameRect());
+
+	return VK_SUCCESS;
+}
+
+void VKLayerSwapchain::FreeReadbackBuffer(int32 readbackIdx)
+{
+	ReadbackBuffer &buffer = fReadbackBuffers[readbackIdx];
+	buffer.bitmap.Unset();
+	buffer.image.Unset();
+	buffer.hostBuffer.Unset();
+	buffer.srcBits = NULL;
+
+	if (!fReadbackCmds.IsSet())
+		return;
+	for (uint32_t family = 0; family < fFamilyCnt; family++) {
+		ReadbackCommands &cmds = fReadbackCmds[family];
+		if (cmds.pool == VK_NULL_HANDLE)
+			continue;
+		for (uint32_t i = 0; i < fImageCnt; i++)
+			cmds.copyCmdRecorded[i * fReadbackCnt + readbackIdx] = false;
+	}
+}
+
+void VKLayerSwapchain::ReleaseIdleBuffers()
+{
+	// Consumes fReadbackPool and the spare list like PreparePresent does. It
+	// runs from Retire() on the thread creating the replacement swapchain,
+	// which is only safe because oldSwapchain must be externally synchronized
+	// with presents to it for the duration of vkCreateSwapchainKHR.
+	if (fZeroCopy || !fReadbackBuffers.IsSet())
+		return;
+	int32 readbackIdx;
+	while (fReadbackPool.TryRemove(readbackIdx))
+		fSpareReadbacks[fSpareReadbackCnt++] = readbackIdx;
+	for (uint32_t i = 0; i < fSpareReadbackCnt; i++)
+		FreeReadbackBuffer(fSpareReadbacks[i]);
+}
+
+VkResult VKLayerSwapchain::CreatePresentRequests()
+{
+	fFamilyCnt = fDevice->GetPhysDevInfo().queueFamilies.size();
+	fReadbackCmds.SetTo(new(std::nothrow) ReadbackCommands[fFamilyCnt]);
+	if (!fReadbackCmds.IsSet())
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	fCopyCmdCnt = fZeroCopy ? fImageCnt : fImageCnt * fReadbackCnt;
+
+	fPresentRequests.SetTo(new(std::nothrow) PresentRequest[fImageCnt]);
+	if (!fPresentRequests.IsSet())
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	if (!fPresentQueue.SetMaxLen(fImageCnt + 1))
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+	for (uint32_t i = 0; i < fImageCnt; i++) {
+		VkSemaphoreCreateInfo semaphoreInfo{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+		VkCheckRet(fDevice->Hooks().CreateSemaphore(fDevice->ToHandle(), &semaphoreInfo, NULL, &fPresentRequests[i].releaseSem));
+		VkCheckRet(fDevice->Hooks().CreateSemaphore(fDevice->ToHandle(), &semaphoreInfo, NULL, &fPresentRequests[i].chainSem));
+	}
+	fPublishDamage.Set(FrameRect());
+
+	fPresentThread = spawn_thread(PresentThreadEntry, "WSI present", B_DISPLAY_PRIORITY, this);
+	if (fPresentThread < 0)
+		return VK_ERROR_INITIALIZATION_FAILED;
+	resume_thread(fPresentThread);
 
 	return VK_SUCCESS;
 }
 
-VkResult VKLayerSwapchain::CopyToBuffer(VkImage srcImage, int32_t width, int32_t height)
+VkResult VKLayerSwapchain::InitReadbackCommands(uint32_t family)
 {
-	// Do the actual blit from the offscreen image to our host visible destination image
+	ReadbackCommands &cmds = fReadbackCmds[family];
+	if (cmds.pool != VK_NULL_HANDLE)
+		return VK_SUCCESS;
+
+	cmds.copyCmds.SetTo(new(std::nothrow) VkCommandBuffer[fCopyCmdCnt]);
+	cmds.copyCmdRecorded.SetTo(new(std::nothrow) bool[fCopyCmdCnt]);
+	if (!cmds.copyCmds.IsSet() || !cmds.copyCmdRecorded.IsSet())
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	std::fill(cmds.copyCmdRecorded.Get(), cmds.copyCmdRecorded.Get() + fCopyCmdCnt, false);
+	ArrayDeleter<VkCommandBuffer> &imageCmds = fZeroCopy ? cmds.returnCmds : cmds.damageCmds;
+	imageCmds.SetTo(new(std::nothrow) VkCommandBuffer[fImageCnt]);
+	if (!imageCmds.IsSet())
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+	VkCommandPoolCreateInfo cmdPoolInfo{
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+		.queueFamilyIndex = family
+	};
+	VkCheckRet(fDevice->Hooks().CreateCommandPool(fDevice->ToHandle(), &cmdPoolInfo, nullptr, &cmds.pool));
+
 	VkCommandBufferAllocateInfo cmdBufAllocateInfo{
 		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-		.commandPool = fCommandPool,
+		.commandPool = cmds.pool,
 		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-		.commandBufferCount = 1
+		.commandBufferCount = fCopyCmdCnt
 	};
-	VkCommandBuffer copyCmd;
-	VkCheckRet(fDevice->Hooks().AllocateCommandBuffers(fDevice->ToHandle(), &cmdBufAllocateInfo, &copyCmd));
+	VkResult res = fDevice->Hooks().AllocateCommandBuffers(fDevice->ToHandle(), &cmdBufAllocateInfo, cmds.copyCmds.Get());
+	if (res == VK_SUCCESS) {
+		cmdBufAllocateInfo.commandBufferCount = fImageCnt;
+		res = fDevice->Hooks().AllocateCommandBuffers(fDevice->ToHandle(), &cmdBufAllocateInfo, imageCmds.Get());
+	}
+	for (uint32 i = 0; res == VK_SUCCESS && fZeroCopy && i < fImageCnt; i++)
+		res = ReturnFromHost(cmds.returnCmds[i], fImages[i].ToHandle());
+	if (res != VK_SUCCESS) {
+		// Destroying the pool frees whatever was allocated from it.
+		fDevice->Hooks().DestroyCommandPool(fDevice->ToHandle(), cmds.pool, nullptr);
+		cmds.pool = VK_NULL_HANDLE;
+		return res;
+	}
+	cmds.granularity = fDevice->GetPhysDevInfo().queueFamilies[family].minImageTransferGranularity;
+
+	return VK_SUCCESS;
+}
+
+void VKLayerSwapchain::FreeReadbackCommands(ReadbackCommands &cmds)
+{
+	if (cmds.pool == VK_NULL_HANDLE)
+		return;
+	fDevice->Hooks().FreeCommandBuffers(fDevice->ToHandle(), cmds.pool, fCopyCmdCnt, cmds.copyCmds.Get());
+	if (cmds.damageCmds.IsSet())
+		fDevice->Hooks().FreeCommandBuffers(fDevice->ToHandle(), cmds.pool, fImageCnt, cmds.damageCmds.Get());
+	if (cmds.returnCmds.IsSet())
+		fDevice->Hooks().FreeCommandBuffers(fDevice->ToHandle(), cmds.pool, fImageCnt, cmds.returnCmds.Get());
+	fDevice->Hooks().DestroyCommandPool(fDevice->ToHandle(), cmds.pool, nullptr);
+	cmds.pool = VK_NULL_HANDLE;
+}
+
+VkResult VKLayerSwapchain::CopyCmd(uint32 imageIdx, int32 readbackIdx, uint32_t family, VkCommandBuffer &copyCmd)
+{
+	ReadbackCommands &cmds = fReadbackCmds[family];
+	uint32 cmdIdx = fZeroCopy ? imageIdx : imageIdx * fReadbackCnt + readbackIdx;
+	copyCmd = cmds.copyCmds[cmdIdx];
+	if (cmds.copyCmdRecorded[cmdIdx])
+		return VK_SUCCESS;
+
+	if (fZeroCopy) {
+		VkCheckRet(MakeHostVisible(copyCmd, fImages[imageIdx].ToHandle()));
+	} else {
+		VkCheckRet(CopyToBuffer(copyCmd, fImages[imageIdx].ToHandle(), fReadbackBuffers[readbackIdx]));
+	}
+	cmds.copyCmdRecorded[cmdIdx] = true;
+
+	return VK_SUCCESS;
+}
+
+void VKLayerSwapchain::AlignCopyRect(clipping_rect &rect, const VkExtent3D &granularity)
+{
+	// A granularity of zero only allows copies of the whole image. Buffer
+	// offsets have to be multiples of 4 bytes on transfer only queues.
+	int32 alignX = granularity.width;
+	int32 alignY = granularity.height;
+	if (alignX == 0 || alignY == 0) {
+		rect = {0, 0, (int32)fImageExtent.width - 1, (int32)fImageExtent.height - 1};
+		return;
+	}
+	if (fBufferReadback)
+		alignX = std::max<int32>(alignX, 4 / fReadbackPixelSize);
+	rect.left -= rect.left % alignX;
+	rect.top -= rect.top % alignY;
+	rect.right = std::min<int32>((rect.right / alignX + 1) * alignX, fImageExtent.width) - 1;
+	rect.bottom = std::min<int32>((rect.bottom / alignY + 1) * alignY, fImageExtent.height) - 1;
+}
+
+VkResult VKLayerSwapchain::CopyToBuffer(VkCommandBuffer copyCmd, VkImage srcImage, ReadbackBuffer &dst, const BRegion *damage, const VkExtent3D &granularity)
+{
+	// Record the blit from the offscreen image to our host visible destination image
 	VkCommandBufferBeginInfo cmdBufInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
 	VkCheckRet(fDevice->Hooks().BeginCommandBuffer(copyCmd, &cmdBufInfo));
 
-	// Transition destination image to transfer destination layout
+	// Transition destination image to transfer destination layout, a partial
+	// copy has to keep the pixels outside of the damage. Buffers have no
+	// layout, and the host is done reading them before the submit.
+	VkImage dstImage = fBufferReadback ? VK_NULL_HANDLE : dst.image->ToHandle();
+	if (dstImage != VK_NULL_HANDLE) {
+		insertImageMemoryBarrier(
+			fDevice,
+			copyCmd,
+			dstImage,
+			0,
+			VK_ACCESS_TRANSFER_WRITE_BIT,
+			damage == NULL ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_GENERAL,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+		);
+	}
+
+	// Presented images are in PRESENT_SRC_KHR layout. The present waits on
+	// its semaphores for all commands, which covers the transfer stage.
 	insertImageMemoryBarrier(
 		fDevice,
 		copyCmd,
-		fBuffer->ToHandle(),
+		srcImage,
 		0,
-		VK_ACCESS_TRANSFER_WRITE_BIT,
-		VK_IMAGE_LAYOUT_UNDEFINED,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_ACCESS_TRANSFER_READ_BIT,
+		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
 		VK_PIPELINE_STAGE_TRANSFER_BIT,
 		VK_PIPELINE_STAGE_TRANSFER_BIT,
 		VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
 	);
 
-	VkOffset3D blitSize{.x = width, .y = height, .z = 1};
-	VkImageBlit imageBlitRegion{
-		.srcSubresource = {
-			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			.layerCount = 1
-		},
-		.srcOffsets = {{}, blitSize},
-		.dstSubresource = {
-			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			.layerCount = 1,
-		},
-		.dstOffsets = {{}, blitSize}
-	};
+	clipping_rect rects[kMaxDamageRects];
+	int32 rectCnt = 1;
+	if (damage == NULL) {
+		rects[0] = {0, 0, (int32)fImageExtent.width - 1, (int32)fImageExtent.height - 1};
+	} else {
+		// Aligned rectangles may overlap, the region splits them up again.
+		BRegion aligned;
+		for (int32 i = 0; i < damage->CountRects(); i++) {
+			clipping_rect rect = damage->RectAtInt(i);
+			AlignCopyRect(rect, granularity);
+			aligned.Include(rect);
+		}
+		if (aligned.CountRects() > kMaxDamageRects) {
+			BRect frame = aligned.Frame();
+			rects[0] = {(int32)frame.left, (int32)frame.top, (int32)frame.right, (int32)frame.bottom};
+		} else {
+			rectCnt = aligned.CountRects();
+			for (int32 i = 0; i < rectCnt; i++)
+				rects[i] = aligned.RectAtInt(i);
+		}
+	}
 
-	// Issue the blit command
-	fDevice->Hooks().CmdBlitImage(
-		copyCmd,
-		srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-		fBuffer->ToHandle(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		1,
-		&imageBlitRegion,
-		VK_FILTER_NEAREST
-	);
+	if (fBufferReadback) {
+		VkBufferImageCopy bufferCopyRegions[kMaxDamageRects];
+		for (int32 i = 0; i < rectCnt; i++) {
+			bufferCopyRegions[i] = {
+				.bufferOffset = (VkDeviceSize)rects[i].top * fReadbackRowPitch + (VkDeviceSize)rects[i].left * fReadbackPixelSize,
+				.bufferRowLength = (uint32_t)(fReadbackRowPitch / fReadbackPixelSize),
+				.bufferImageHeight = 0,
+				.imageSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1
+				},
+				.imageOffset = {.x = rects[i].left, .y = rects[i].top, .z = 0},
+				.imageExtent = {
+					.width = (uint32_t)(rects[i].right - rects[i].left + 1),
+					.height = (uint32_t)(rects[i].bottom - rects[i].top + 1),
+					.depth = 1
+				}
+			};
+		}
+		if (rectCnt > 0) {
+			fDevice->Hooks().CmdCopyImageToBuffer(
+				copyCmd,
+				srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				dst.hostBuffer->ToHandle(),
+				rectCnt,
+				bufferCopyRegions
+			);
+		}
+	} else if (fCopyImage) {
+		VkImageCopy imageCopyRegions[kMaxDamageRects];
+		for (int32 i = 0; i < rectCnt; i++) {
+			VkOffset3D offset{.x = rects[i].left, .y = rects[i].top, .z = 0};
+			imageCopyRegions[i] = {
+				.srcSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1
+				},
+				.srcOffset = offset,
+				.dstSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1
+				},
+				.dstOffset = offset,
+				.extent = {
+					.width = (uint32_t)(rects[i].right - rects[i].left + 1),
+					.height = (uint32_t)(rects[i].bottom - rects[i].top + 1),
+					.depth = 1
+				}
+			};
+		}
+		if (rectCnt > 0) {
+			fDevice->Hooks().CmdCopyImage(
+				copyCmd,
+				srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				rectCnt,
+				imageCopyRegions
+			);
+		}
+	} else {
+		VkImageBlit imageBlitRegions[kMaxDamageRects];
+		for (int32 i = 0; i < rectCnt; i++) {
+			VkOffset3D blitMin{.x = rects[i].left, .y = rects[i].top, .z = 0};
+			VkOffset3D blitMax{.x = rects[i].right + 1, .y = rects[i].bottom + 1, .z = 1};
+			imageBlitRegions[i] = {
+				.srcSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1
+				},
+				.srcOffsets = {blitMin, blitMax},
+				.dstSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.layerCount = 1,
+				},
+				.dstOffsets = {blitMin, blitMax}
+			};
+		}
+
+		if (rectCnt > 0) {
+			fDevice->Hooks().CmdBlitImage(
+				copyCmd,
+				srcImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				rectCnt,
+				imageBlitRegions,
+				VK_FILTER_NEAREST
+			);
+		}
+	}
 
-	// Transition destination image to general layout, which is the required layout for mapping the image memory later on
+	// The application gets the image back in the layout it presented it in.
 	insertImageMemoryBarrier(
 		fDevice,
 		copyCmd,
-		fBuffer->ToHandle(),
-		VK_ACCESS_TRANSFER_WRITE_BIT,
-		VK_ACCESS_MEMORY_READ_BIT,
-		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		VK_IMAGE_LAYOUT_GENERAL,
-		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		srcImage,
+		0,
+		0,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
 		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
 		VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
 	);
 
+	// Transition destination image to general layout, which is the required layout for mapping the image memory later on.
+	// The host read access makes the copy available to InvalidateHostCache().
+	if (dstImage != VK_NULL_HANDLE) {
+		insertImageMemoryBarrier(
+			fDevice,
+			copyCmd,
+			dstImage,
+			VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_ACCESS_HOST_READ_BIT,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_IMAGE_LAYOUT_GENERAL,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_HOST_BIT,
+			VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+		);
+	} else {
+		VkMemoryBarrier memoryBarrier{
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_HOST_READ_BIT
+		};
+		fDevice->Hooks().CmdPipelineBarrier(
+			copyCmd,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_HOST_BIT,
+			0,
+			1, &memoryBarrier,
+			0, nullptr,
+			0, nullptr
+		);
+	}
+
 	VkCheckRet(fDevice->Hooks().EndCommandBuffer(copyCmd));
 
-	VkCheckRet(submitWork(fDevice, copyCmd, fQueue));
-	fDevice->Hooks().FreeCommandBuffers(fDevice->ToHandle(), fCommandPool, 1, &copyCmd);
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSwapchain::MakeHostVisible(VkCommandBuffer cmd, VkImage image)
+{
+	// Zero copy images are read by the consumer directly. The host may only
+	// access image memory in GENERAL layout.
+	VkCommandBufferBeginInfo cmdBufInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+	VkCheckRet(fDevice->Hooks().BeginCommandBuffer(cmd, &cmdBufInfo));
+
+	insertImageMemoryBarrier(
+		fDevice,
+		cmd,
+		image,
+		VK_ACCESS_MEMORY_WRITE_BIT,
+		VK_ACCESS_HOST_READ_BIT,
+		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		VK_IMAGE_LAYOUT_GENERAL,
+		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+		VK_PIPELINE_STAGE_HOST_BIT,
+		VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+	);
+
+	VkCheckRet(fDevice->Hooks().EndCommandBuffer(cmd));
+
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSwapchain::ReturnFromHost(VkCommandBuffer cmd, VkImage image)
+{
+	// Applications may transition acquired images from PRESENT_SRC_KHR. The
+	// host is done reading before the image is acquired again.
+	VkCommandBufferBeginInfo cmdBufInfo{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+	VkCheckRet(fDevice->Hooks().BeginCommandBuffer(cmd, &cmdBufInfo));
+
+	insertImageMemoryBarrier(
+		fDevice,
+		cmd,
+		image,
+		0,
+		0,
+		VK_IMAGE_LAYOUT_GENERAL,
+		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+		VkImageSubresourceRange{VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1}
+	);
+
+	VkCheckRet(fDevice->Hooks().EndCommandBuffer(cmd));
 
 	return VK_SUCCESS;
 }
 
+VkQueue VKLayerSwapchain::ReadbackQueue(VkQueue presentQueue, uint32_t &family)
+{
+	uint32_t presentFamily = fDevice->GetQueueFamily(presentQueue);
+	VkQueue queue = fBlit ? fDevice->GetBlitQueue() : fDevice->GetTransferQueue();
+	family = fBlit ? fDevice->GetBlitFamily() : fDevice->GetTransferFamily();
+	if (queue != VK_NULL_HANDLE && (fConcurrent || family == presentFamily))
+		return queue;
+
+	// Zero copy images must be read on a layer queue, which returns them to
+	// the application on acquire. They are not shown otherwise.
+	if (fZeroCopy) {
+		family = fDevice->GetBlitFamily();
+		if (fDevice->GetBlitQueue() != VK_NULL_HANDLE && family == presentFamily)
+			return fDevice->GetBlitQueue();
+		return VK_NULL_HANDLE;
+	}
+
+	// Otherwise the readback runs on the presenting queue, which the caller
+	// synchronizes for the present call. Frames that need a blit are not
+	// read back if it can not do one.
+	family = presentFamily;
+	if (family == UINT32_MAX)
+		return VK_NULL_HANDLE;
+	if (fBlit && (fDevice->GetPhysDevInfo().queueFamilies[family].queueFlags & VK_QUEUE_GRAPHICS_BIT) == 0)
+		return VK_NULL_HANDLE;
+	return presentQueue;
+}
+
 VkResult VKLayerSwapchain::CheckSuboptimal()
 {
 	auto bitmapHook = fSurface->GetBitmapHook();
@@ -595,6 +1594,274 @@ VkResult VKLayerSwapchain::CheckSuboptimal()
 	return VK_SUCCESS;
 }
 
+void VKLayerSwapchain::GetPresentDamage(const VkPresentInfoKHR *presentInfo, uint32_t idx, BRegion &damage)
+{
+	// No regions, or no rectangles for this swapchain, mean the whole image changed.
+	damage.Set(FrameRect());
+	auto presentRegions = (const VkPresentRegionsKHR*)findNextStruct(presentInfo->pNext, VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR);
+	if (presentRegions == NULL || presentRegions->pRegions == NULL || idx >= presentRegions->swapchainCount)
+		return;
+	const VkPresentRegionKHR &region = presentRegions->pRegions[idx];
+	if (region.rectangleCount == 0 || region.pRectangles == NULL)
+		return;
+
+	damage.MakeEmpty();
+	for (uint32_t i = 0; i < region.rectangleCount; i++) {
+		const VkRectLayerKHR &rect = region.pRectangles[i];
+		if (rect.extent.width == 0 || rect.extent.height == 0)
+			continue;
+		damage.Include(clipping_rect{
+			rect.offset.x, rect.offset.y,
+			rect.offset.x + (int32)rect.extent.width - 1, rect.offset.y + (int32)rect.extent.height - 1
+		});
+	}
+	BRegion frame(FrameRect());
+	damage.IntersectWith(&frame);
+}
+
+VkResult VKLayerSwapchain::PrepareReadback(PresentRequest &request, uint32 imageIdx, uint32_t family, VkCommandBuffer &copyCmd)
+{
+	copyCmd = VK_NULL_HANDLE;
+
+	// Every other buffer misses this frame's damage now, the target only has
+	// to catch up with what changed since it was filled last.
+	for (uint32_t i = 0; i < fReadbackCnt; i++) {
+		if ((int32)i != request.readbackIdx)
+			fReadbackBuffers[i].stale.Include(&request.damage);
+	}
+	if (request.readbackIdx < 0)
+		return VK_SUCCESS;
+
+	ReadbackBuffer &buffer = fReadbackBuffers[request.readbackIdx];
+	if (!buffer.bitmap.IsSet()) {
+		VkCheckRet(InitReadbackBuffer(request.readbackIdx));
+	}
+	buffer.stale.Include(&request.damage);
+	BRegion damage(buffer.stale);
+	buffer.stale.MakeEmpty();
+	if (buffer.srcBits != NULL)
+		buffer.unconverted.Include(&damage);
+
+	BRect frame = FrameRect();
+	BRect bounds = damage.Frame();
+	if (damage.CountRects() == 1 && bounds.left <= frame.left && bounds.top <= frame.top && bounds.right >= frame.right && bounds.bottom >= frame.bottom)
+		return CopyCmd(imageIdx, request.readbackIdx, family, copyCmd);
+
+	ReadbackCommands &cmds = fReadbackCmds[family];
+	if (CopyToBuffer(cmds.damageCmds[imageIdx], fImages[imageIdx].ToHandle(), buffer, &damage, cmds.granularity) != VK_SUCCESS)
+		return CopyCmd(imageIdx, request.readbackIdx, family, copyCmd);
+	copyCmd = cmds.damageCmds[imageIdx];
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSwapchain::InvalidateReadback(int32 readbackIdx)
+{
+	if (fBufferReadback)
+		return fReadbackBuffers[readbackIdx].hostBuffer->InvalidateHostCache();
+	return ReadbackImage(readbackIdx).InvalidateHostCache();
+}
+
+void VKLayerSwapchain::DisableReadbackRecycle(int32 readbackIdx)
+{
+	if (fBufferReadback)
+		fReadbackBuffers[readbackIdx].hostBuffer->DisableRecycle();
+	else
+		ReadbackImage(readbackIdx).DisableRecycle();
+}
+
+void VKLayerSwapchain::ConvertBuffer(int32 readbackIdx)
+{
+	ReadbackBuffer &buffer = fReadbackBuffers[readbackIdx];
+	uint8 *bits = (uint8*)buffer.bitmap->Bits();
+	size_t stride = buffer.bitmap->BytesPerRow();
+	size_t pixelSize = 4;
+	get_pixel_size_for(fColorSpace, &pixelSize, NULL, NULL);
+	for (int32 i = 0; i < buffer.unconverted.CountRects(); i++) {
+		clipping_rect rect = buffer.unconverted.RectAtInt(i);
+		uint32 width = rect.right - rect.left + 1;
+		// Bitmaps of buffer readbacks have the same row pitch, full rows are
+		// copied at once.
+		if (!fConvert && stride == buffer.srcStride && width == fImageExtent.width) {
+			memcpy(bits + rect.top*stride, buffer.srcBits + rect.top*stride, (rect.bottom - rect.top + 1)*stride);
+			continue;
+		}
+		for (int32 y = rect.top; y <= rect.bottom; y++) {
+			uint8 *dst = bits + y*stride;
+			const uint8 *src = buffer.srcBits + y*buffer.srcStride;
+			if (fConvert)
+				fConversion.convertRow((uint32*)dst + rect.left, src + rect.left*fConversion.srcPixelSize, width);
+			else
+				memcpy(dst + rect.left*pixelSize, src + rect.left*pixelSize, width*pixelSize);
+		}
+	}
+	buffer.unconverted.MakeEmpty();
+}
+
+bool VKLayerSwapchain::DetectDamage(int32 readbackIdx)
+{
+	// Only frames shown to the same hook can be compared.
+	if (fPublishedIdx < 0 || fPublishedIdx == readbackIdx || fSurface->GetBitmapHook() != fPublishHook || !fReadbackBuffers[readbackIdx].bitmap.IsSet())
+		return true;
+
+	BBitmap *bitmap = fReadbackBuffers[readbackIdx].bitmap.Get();
+	BBitmap *prevBitmap = fReadbackBuffers[fPublishedIdx].bitmap.Get();
+	const uint8_t *bits = (const uint8_t*)bitmap->Bits();
+	const uint8_t *prevBits = (const uint8_t*)prevBitmap->Bits();
+	size_t stride = bitmap->BytesPerRow();
+	size_t prevStride = prevBitmap->BytesPerRow();
+	size_t pixelSize = 4;
+	get_pixel_size_for(fColorSpace, &pixelSize, NULL, NULL);
+
+	BRegion damage;
+	for (int32 top = 0; top < (int32)fImageExtent.height; top += kDamageTileSize) {
+		int32 bottom = std::min<int32>(top + kDamageTileSize, fImageExtent.height) - 1;
+		for (int32 left = 0; left < (int32)fImageExtent.width; left += kDamageTileSize) {
+			int32 right = std::min<int32>(left + kDamageTileSize, fImageExtent.width) - 1;
+			clipping_rect tile{left, top, right, bottom};
+			if (!fPublishDamage.Intersects(BRect(left, top, right, bottom)))
+				continue;
+			if (RowsDiffer(
+				bits + top*stride + pixelSize*left, stride,
+				prevBits + top*prevStride + pixelSize*left, prevStride,
+				pixelSize*(right - left + 1), bottom - top + 1
+			))
+				damage.Include(tile);
+		}
+	}
+	fPublishDamage = damage;
+	return fPublishDamage.CountRects() > 0;
+}
+
+void VKLayerSwapchain::Publish(int32 readbackIdx)
+{
+	uint32 bitmapHookFlags;
+	auto bitmapHook = fSurface->GetBitmapHook(bitmapHookFlags);
+
+	// A hook that did not see the previous frame needs all of this one.
+	if (bitmapHook != fPublishHook) {
+		ReclaimBitmaps();
+		fPublishDamage.Set(FrameRect());
+		fPublishHook = bitmapHook;
+	}
+
+	BBitmap *bitmap = fReadbackBuffers[readbackIdx].bitmap.Get();
+	if (bitmapHook == NULL || bitmap == NULL) {
+		ReleaseBuffer(readbackIdx);
+		return;
+	}
+
+	fSurface->AddBitmap(bitmap, this, readbackIdx);
+	BBitmap *prevBitmap;
+	if ((bitmapHookFlags & BITMAP_HOOK_DAMAGE) != 0)
+		prevBitmap = bitmapHook->UpdateBitmap(bitmap, fPublishDamage);
+	else
+		prevBitmap = bitmapHook->SetBitmap(bitmap);
+	fPublishDamage.MakeEmpty();
+	fPublishedIdx = readbackIdx;
+	fSurface->ReleaseBitmap(prevBitmap);
+}
+
+void VKLayerSwapchain::ReclaimBitmaps()
+{
+	// A replaced or removed hook never gives its bitmap back. The bitmap is
+	// left to it, and the buffer is used again with new memory, or a new
+	// bitmap of the swapchain image in zero copy mode.
+	std::vector<int32> readbackIdxs;
+	fSurface->OrphanBitmaps(this, readbackIdxs);
+	for (int32 readbackIdx: readbackIdxs) {
+		ReadbackBuffer &buffer = fReadbackBuffers[readbackIdx];
+		buffer.bitmap.Detach();
+		DisableReadbackRecycle(readbackIdx);
+		// If this fails the image is never shown, Publish() gives it back.
+		if (fZeroCopy)
+			CreateBitmap(buffer, fImages[readbackIdx]);
+		if (readbackIdx == fPublishedIdx)
+			fPublishedIdx = -1;
+		ReleaseBuffer(readbackIdx);
+	}
+}
+
+void VKLayerSwapchain::ReleaseBuffer(int32 readbackIdx)
+{
+	if (fZeroCopy)
+		fImagePool.Add(readbackIdx);
+	else
+		fReadbackPool.Add(readbackIdx);
+}
+
+void VKLayerSwapchain::ReleaseBitmap(int32 readbackIdx)
+{
+	ReleaseBuffer(readbackIdx);
+}
+
+void VKLayerSwapchain::CompletePresent(uint64 presentId)
+{
+	if (presentId == 0)
+		return;
+	PthreadMutexLocker lock(&fPresentIdLock);
+	if (presentId > fPresentIdDone) {
+		fPresentIdDone = presentId;
+		pthread_cond_broadcast(&fPresentIdCond);
+	}
+}
+
+status_t VKLayerSwapchain::PresentThreadEntry(void *arg)
+{
+	((VKLayerSwapchain*)arg)->PresentThread();
+	return B_OK;
+}
+
+void VKLayerSwapchain::PresentThread()
+{
+	for (;;) {
+		int32 imageIdx = fPresentQueue.Remove();
+		if (imageIdx < 0)
+			break;
+
+		PresentRequest &request = fPresentRequests[imageIdx];
+		if (request.released) {
+			request.released = false;
+			fImagePool.Add(imageIdx);
+			continue;
+		}
+		if (request.fence != NULL) {
+			request.fence->Wait();
+			request.fence->ReleaseReference();
+			request.fence = NULL;
+		}
+		int32 readbackIdx = request.readbackIdx;
+		request.readbackIdx = -1;
+		// Frames that are skipped or dropped still count as damage of the next one shown.
+		fPublishDamage.Include(&request.damage);
+		if (readbackIdx >= 0) {
+			// In mailbox mode a newer present replaces this one before it is
+			// shown, frames identical to the shown one are dropped as well.
+			// Replaced frames are not converted, their damage stays in the
+			// unconverted region of the buffer.
+			if (request.presentMode == VK_PRESENT_MODE_MAILBOX_KHR && fPresentQueue.Length() > 0) {
+				ReleaseBuffer(readbackIdx);
+			} else {
+				InvalidateReadback(readbackIdx);
+				if (fReadbackBuffers[readbackIdx].srcBits != NULL)
+					ConvertBuffer(readbackIdx);
+				if (fDetectDamage && !DetectDamage(readbackIdx))
+					ReleaseBuffer(readbackIdx);
+				else
+					Publish(readbackIdx);
+			}
+		}
+
+		uint64 presentId = request.presentId;
+		request.presentId = 0;
+
+		// Published zero copy images come back through ReleaseBitmap().
+		if (!(fZeroCopy && readbackIdx >= 0))
+			fImagePool.Add(imageIdx);
+
+		CompletePresent(presentId);
+	}
+}
+
 VkResult VKLayerSwapchain::Init(LayerDevice *device, const VkSwapchainCreateInfoKHR &createInfo)
 {
 	fDevice = device;
@@ -602,44 +1869,86 @@ VkResult VKLayerSwapchain::Init(LayerDevice *device, const VkSwapchainCreateInfo
 
 	VKLayerSwapchain *oldSwapchain = NULL;
 	if (createInfo.oldSwapchain != NULL) {
-		if (fSurface->fSwapchain == NULL || createInfo.oldSwapchain != fSurface->fSwapchain->ToHandle()) {
-			return VK_ERROR_NATIVE_WINDOW_IN_USE_KHR;
-		}
 		oldSwapchain = VKLayerSwapchain::FromHandle(createInfo.oldSwapchain);
+		if (!fSurface->IsCurrentSwapchain(oldSwapchain))
+			return VK_ERROR_NATIVE_WINDOW_IN_USE_KHR;
 	}
 
-	VkFenceCreateInfo fence_info{VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, nullptr, 0};
-	VkCheckRet(fDevice->Hooks().CreateFence(fDevice->ToHandle(), &fence_info, NULL, &fFence));
+	if (!IsPresentModeSupported(createInfo.presentMode))
+		return VK_ERROR_INITIALIZATION_FAILED;
+	fPresentMode = createInfo.presentMode;
+
+	// All supported modes are compatible, presents may switch between them.
+	auto presentModes = (const VkSwapchainPresentModesCreateInfoEXT*)findNextStruct(createInfo.pNext, VK_STRUCTURE_TYPE_SWAPCHAIN_PRESENT_MODES_CREATE_INFO_EXT);
+	if (presentModes != NULL) {
+		for (uint32_t i = 0; i < presentModes->presentModeCount; i++) {
+			if (!IsPresentModeSupported(presentModes->pPresentModes[i]))
+				return VK_ERROR_INITIALIZATION_FAILED;
+		}
+	}
 
 	fImageExtent = createInfo.imageExtent;
+	fZeroCopy = CanZeroCopy(createInfo);
+	// Zero copy images are shared with the consumer right away.
+	fDeferredAlloc = !fZeroCopy && (createInfo.flags & VK_SWAPCHAIN_CREATE_DEFERRED_MEMORY_ALLOCATION_BIT_EXT) != 0;
+	SelectReadbackFormat(createInfo.imageFormat);
+	fBlit = !fZeroCopy && !fCopyImage;
 
-	VkImageCreateInfo imageCreateInfo = ImageFromCreateInfo(createInfo);
+	const char *detectDamage = getenv("VIDEOSTREAMS_WSI_DETECT_DAMAGE");
+	fDetectDamage = detectDamage != NULL && strcmp(detectDamage, "1") == 0;
+
+	std::vector<uint32_t> queueFamilies;
+	VkImageCreateInfo imageCreateInfo = ImageFromCreateInfo(createInfo, queueFamilies);
 
 	fImageCnt = createInfo.minImageCount;
+	if (fZeroCopy) {
+		// The image shown last is held by the BitmapHook.
+		fImageCnt++;
+		fReadbackCnt = fImageCnt;
+		fReadbackBuffers.SetTo(new(std::nothrow) ReadbackBuffer[fReadbackCnt]);
+		if (!fReadbackBuffers.IsSet())
+			return VK_ERROR_OUT_OF_HOST_MEMORY;
+	}
 	fImages.SetTo(new(std::nothrow) VKLayerImage[fImageCnt]);
 	if (!fImages.IsSet())
 		return VK_ERROR_OUT_OF_HOST_MEMORY;
-	if(!fImagePool.SetMaxLen(fImageCnt))
+	if(!fImagePool.SetMaxLen(fImageCnt, fZeroCopy))
 		return VK_ERROR_OUT_OF_HOST_MEMORY;
 
 	for (uint32_t i = 0; i < fImageCnt; i++) {
-		VkCheckRet(fImages[i].Init(device, imageCreateInfo));
+		if (fZeroCopy) {
+			VkCheckRet(fImages[i].Init(device, imageCreateInfo, true, true));
+			VkCheckRet(CreateBitmap(fReadbackBuffers[i], fImages[i]));
+		} else {
+			VkCheckRet(fImages[i].Init(device, imageCreateInfo, false, false, fDeferredAlloc));
+		}
 		fImagePool.Add(i);
 	}
 
-	fDevice->Hooks().GetDeviceQueue(fDevice->ToHandle(), 0, 0, &fQueue);
-	//VkCheckRet(vkSetDeviceLoaderData(device, fQueue));
-
-	VkCheckRet(CreateBuffer());
+	if (!fZeroCopy)
+		VkCheckRet(CreateReadbackBuffers());
+	VkCheckRet(CreatePresentRequests());
 
-	if (oldSwapchain != NULL) {
-		oldSwapchain->fRetired = true;
-	}
-	fSurface->fSwapchain = this;
+	// Another swapchain may have replaced oldSwapchain in the meantime.
+	if (!fSurface->AttachSwapchain(this, oldSwapchain))
+		return VK_ERROR_NATIVE_WINDOW_IN_USE_KHR;
+	if (oldSwapchain != NULL)
+		oldSwapchain->Retire();
 
 	return VK_SUCCESS;
 }
 
+void VKLayerSwapchain::Retire()
+{
+	{
+		PthreadMutexLocker lock(&fPresentIdLock);
+		fRetired = true;
+		pthread_cond_broadcast(&fPresentIdCond);
+	}
+	// Presents of already acquired images allocate again if needed.
+	ReleaseIdleBuffers();
+}
+
 VkResult VKLayerSwapchain::GetSwapchainImages(uint32_t *count, VkImage *images)
 {
 	if (images == NULL) {
@@ -657,55 +1966,194 @@ VkResult VKLayerSwapchain::GetSwapchainImages(uint32_t *count, VkImage *images)
 
 VkResult VKLayerSwapchain::AcquireNextImage(const VkAcquireNextImageInfoKHR *pAcquireInfo, uint32_t *pImageIndex)
 {
-	int32 imageIdx = fImagePool.Remove();
+	int32 imageIdx;
+	switch (fImagePool.Remove(imageIdx, timeoutFromVk(pAcquireInfo->timeout))) {
+		case B_OK:
+			break;
+		case B_WOULD_BLOCK:
+			return VK_NOT_READY;
+		default:
+			return VK_TIMEOUT;
+	}
+	if (!fImages[imageIdx].IsAllocated()) {
+		VkResult res = fImages[imageIdx].Allocate();
+		if (res != VK_SUCCESS) {
+			PresentRequest &request = fPresentRequests[imageIdx];
+			request.released = true;
+			fPresentQueue.Add(imageIdx);
+			return res;
+		}
+	}
 	*pImageIndex = imageIdx;
 
-	if (VK_NULL_HANDLE != pAcquireInfo->semaphore || VK_NULL_HANDLE != pAcquireInfo->fence) {
+	// The image may still be read by its last present, the release semaphore
+	// has to be waited on even if the application asks for no signal.
+	PresentRequest &request = fPresentRequests[imageIdx];
+	if (VK_NULL_HANDLE != pAcquireInfo->semaphore || VK_NULL_HANDLE != pAcquireInfo->fence || request.releasePending || request.hostQueue != VK_NULL_HANDLE) {
 		VkSubmitInfo submit = {VK_STRUCTURE_TYPE_SUBMIT_INFO};
-	
+		VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+		if (request.releasePending) {
+			submit.waitSemaphoreCount = 1;
+			submit.pWaitSemaphores = &request.releaseSem;
+			submit.pWaitDstStageMask = &waitStage;
+		}
 		if (VK_NULL_HANDLE != pAcquireInfo->semaphore) {
 			submit.signalSemaphoreCount = 1;
 			submit.pSignalSemaphores = &pAcquireInfo->semaphore;
 		}
 	
-		submit.commandBufferCount = 0;
-		submit.pCommandBuffers = nullptr;
-		VkCheckRet(fDevice->Hooks().QueueSubmit(fQueue, 1, &submit, pAcquireInfo->fence));
+		if (request.hostQueue != VK_NULL_HANDLE) {
+			submit.commandBufferCount = 1;
+			submit.pCommandBuffers = &fReadbackCmds[request.hostFamily].returnCmds[imageIdx];
+			VkCheckRet(fDevice->Submit(request.hostQueue, 1, &submit, pAcquireInfo->fence));
+		} else {
+			submit.commandBufferCount = 0;
+			submit.pCommandBuffers = nullptr;
+			VkCheckRet(fDevice->SubmitTransfer(1, &submit, pAcquireInfo->fence));
+		}
+		request.releasePending = false;
+		request.hostQueue = VK_NULL_HANDLE;
 	}
 
 	return CheckSuboptimal();
 }
 
-VkResult VKLayerSwapchain::QueuePresent(VkQueue queue, const VkPresentInfoKHR *presentInfo, uint32_t idx)
+VkResult VKLayerSwapchain::PreparePresent(VkQueue queue, const VkPresentInfoKHR *presentInfo, uint32_t idx, PresentSubmit &submit)
 {
-	fDevice->Hooks().ResetFences(fDevice->ToHandle(), 1, &fFence);
-	VkPipelineStageFlags pipeline_stage_flags = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-
-	VkSubmitInfo submit_info = {
-		VK_STRUCTURE_TYPE_SUBMIT_INFO, NULL, presentInfo->waitSemaphoreCount, presentInfo->pWaitSemaphores, &pipeline_stage_flags, 0, NULL, 0, NULL
-	};
-
-	VkResult result = fDevice->Hooks().QueueSubmit(queue, 1, &submit_info, fFence);
-	if (result == VK_SUCCESS) {
-		fDevice->Hooks().WaitForFences(fDevice->ToHandle(), 1, &fFence, VK_TRUE, UINT64_MAX);
+	uint32_t imageIdx = presentInfo->pImageIndices[idx];
+	PresentRequest &request = fPresentRequests[imageIdx];
+	submit.imageIdx = imageIdx;
+	GetPresentDamage(presentInfo, idx, request.damage);
+
+	request.presentId = 0;
+	auto presentIds = (const VkPresentIdKHR*)findNextStruct(presentInfo->pNext, VK_STRUCTURE_TYPE_PRESENT_ID_KHR);
+	if (presentIds != NULL && presentIds->pPresentIds != NULL && idx < presentIds->swapchainCount) {
+		request.presentId = presentIds->pPresentIds[idx];
+		if (request.presentId > fLastPresentId.load(std::memory_order_relaxed))
+			fLastPresentId.store(request.presentId, std::memory_order_relaxed);
 	}
 
-	uint32_t imageIdx = presentInfo->pImageIndices[idx];
-	/*assert(*/fImagePool.Add(imageIdx)/*)*/;
+	auto presentModes = (const VkSwapchainPresentModeInfoEXT*)findNextStruct(presentInfo->pNext, VK_STRUCTURE_TYPE_SWAPCHAIN_PRESENT_MODE_INFO_EXT);
+	if (presentModes != NULL && idx < presentModes->swapchainCount)
+		fPresentMode = presentModes->pPresentModes[idx];
+	request.presentMode = fPresentMode;
 
-	auto bitmapHook = fSurface->GetBitmapHook();
-	if (bitmapHook != NULL) {
-		CopyToBuffer(fImages[imageIdx].ToHandle(), fImageExtent.width, fImageExtent.height);
-		if (fBitmap.IsSet()) {
-			delete bitmapHook->SetBitmap(fBitmap.Detach());
+	uint32_t family;
+	submit.queue = ReadbackQueue(queue, family);
+	bool readback = submit.queue != VK_NULL_HANDLE;
+	if (!readback)
+		submit.queue = queue;
+
+	if (readback && fSurface->GetBitmapHook() != NULL) {
+		if (fZeroCopy) {
+			request.readbackIdx = imageIdx;
 		} else {
-			bitmapHook->SetBitmap(fCurBitmap);
+			// FIFO style modes wait until the consumer gives a buffer back,
+			// immediate mode rather skips the readback of this frame.
+			if (fSpareReadbackCnt > 0)
+				request.readbackIdx = fSpareReadbacks[--fSpareReadbackCnt];
+			else if (fPresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR)
+				fReadbackPool.TryRemove(request.readbackIdx);
+			else
+				request.readbackIdx = fReadbackPool.Remove();
 		}
 	}
 
+	VkCommandBuffer copyCmd = VK_NULL_HANDLE;
+	VkResult res = VK_SUCCESS;
+	if (request.readbackIdx >= 0)
+		res = InitReadbackCommands(family);
+	if (res == VK_SUCCESS && !fZeroCopy)
+		res = PrepareReadback(request, imageIdx, family, copyCmd);
+	else if (res == VK_SUCCESS && request.readbackIdx >= 0)
+		res = CopyCmd(imageIdx, request.readbackIdx, family, copyCmd);
+	if (res != VK_SUCCESS) {
+		if (!fZeroCopy && request.readbackIdx >= 0)
+			fSpareReadbacks[fSpareReadbackCnt++] = request.readbackIdx;
+		request.readbackIdx = -1;
+		request.released = true;
+		fPresentQueue.Add(imageIdx);
+		return res;
+	}
+
+	if (fZeroCopy && request.readbackIdx >= 0) {
+		request.hostQueue = submit.queue;
+		request.hostFamily = family;
+	}
+
+	submit.cmd = copyCmd;
+	submit.releaseSem = request.releaseSem;
+	submit.chainSem = request.chainSem;
+	// Only frames whose pixels or completion the host needs are fenced, and
+	// work on application queues, which the layer can not wait idle.
+	submit.fenced = request.readbackIdx >= 0 || request.presentId != 0 || !fDevice->OwnsQueue(submit.queue);
+	submit.prepared = true;
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSwapchain::FinishPresent(const VkPresentInfoKHR *presentInfo, uint32_t idx, PresentSubmit &submit)
+{
+	PresentRequest &request = fPresentRequests[submit.imageIdx];
+	if (submit.result != VK_SUCCESS) {
+		if (!fZeroCopy && request.readbackIdx >= 0)
+			fSpareReadbacks[fSpareReadbackCnt++] = request.readbackIdx;
+		request.readbackIdx = -1;
+		request.hostQueue = VK_NULL_HANDLE;
+		request.released = true;
+		fPresentQueue.Add(submit.imageIdx);
+		return submit.result;
+	}
+	request.fence = submit.fence;
+	submit.fence = NULL;
+	request.releasePending = true;
+	fPresentQueue.Add(submit.imageIdx);
+
+	// The application semaphores are consumed by the submission of the
+	// present, an empty one behind it signals when they can be reused.
+	auto presentFences = (const VkSwapchainPresentFenceInfoEXT*)findNextStruct(presentInfo->pNext, VK_STRUCTURE_TYPE_SWAPCHAIN_PRESENT_FENCE_INFO_EXT);
+	if (presentFences != NULL && idx < presentFences->swapchainCount && presentFences->pFences[idx] != VK_NULL_HANDLE)
+		VkCheckRet(fDevice->Submit(submit.queue, 0, NULL, presentFences->pFences[idx]));
+
 	return CheckSuboptimal();
 }
 
+VkResult VKLayerSwapchain::ReleaseImages(const VkReleaseSwapchainImagesInfoEXT *releaseInfo)
+{
+	// fImagePool is filled by fPresentThread only, so released images take
+	// the same way as presented ones.
+	for (uint32_t i = 0; i < releaseInfo->imageIndexCount; i++) {
+		uint32_t imageIdx = releaseInfo->pImageIndices[i];
+		fPresentRequests[imageIdx].released = true;
+		fPresentQueue.Add(imageIdx);
+	}
+	return VK_SUCCESS;
+}
+
+VkResult VKLayerSwapchain::WaitForPresent(uint64_t presentId, uint64_t timeout)
+{
+	bigtime_t relTimeout = timeoutFromVk(timeout);
+	timespec deadline;
+	if (relTimeout != B_INFINITE_TIMEOUT)
+		deadlineFromTimeout(relTimeout, deadline);
+
+	PthreadMutexLocker lock(&fPresentIdLock);
+	while (fPresentIdDone < presentId) {
+		// A retired swapchain will not see any present it did not get yet.
+		if (fRetired && presentId > fLastPresentId.load(std::memory_order_relaxed))
+			return VK_ERROR_OUT_OF_DATE_KHR;
+		if (relTimeout <= 0)
+			return VK_TIMEOUT;
+		if (relTimeout == B_INFINITE_TIMEOUT) {
+			pthread_cond_wait(&fPresentIdCond, &fPresentIdLock);
+		} else if (pthread_cond_timedwait(&fPresentIdCond, &fPresentIdLock, &deadline) == ETIMEDOUT) {
+			if (fPresentIdDone < presentId)
+				return VK_TIMEOUT;
+		}
+	}
+	return VK_SUCCESS;
+}
+
 
 //#pragma mark - Surface
 
@@ -729,11 +2177,7 @@ void Layer_DestroySurfaceKHR(VkInstance instance, VkSurfaceKHR surface, const Vk
 
 VkResult Layer_GetPhysicalDeviceSurfaceCapabilities2KHR(VkPhysicalDevice physDev, const VkPhysicalDeviceSurfaceInfo2KHR *surface_info, VkSurfaceCapabilities2KHR *capabilities)
 {
-	(void)physDev;
-	(void)surface_info;
-	(void)capabilities;
-	fprintf(stderr, "vkGetPhysicalDeviceSurfaceCapabilities2KHR(): not implemented\n");
-	return VK_NOT_READY;
+	return VKLayerSurface::FromHandle(surface_info->surface)->GetCapabilities2(physDev, surface_info, capabilities);
 }
 
 VkResult Layer_GetPhysicalDeviceSurfaceCapabilitiesKHR(VkPhysicalDevice physDev, VkSurfaceKHR surface, VkSurfaceCapabilitiesKHR *capabilities)
@@ -743,12 +2187,17 @@ VkResult Layer_GetPhysicalDeviceSurfaceCapabilitiesKHR(VkPhysicalDevice physDev,
 
 VkResult Layer_GetPhysicalDeviceSurfaceFormats2KHR(VkPhysicalDevice physDev, const VkPhysicalDeviceSurfaceInfo2KHR *surface_info, uint32_t *count, VkSurfaceFormat2KHR *formats)
 {
-	(void)physDev;
-	(void)surface_info;
-	(void)count;
-	(void)formats;
-	fprintf(stderr, "vkGetPhysicalDeviceSurfaceFormats2KHR(): not implemented\n");
-	return VK_NOT_READY;
+	VKLayerSurface *surface = VKLayerSurface::FromHandle(surface_info->surface);
+	if (formats == NULL)
+		return surface->GetFormats(physDev, count, NULL);
+
+	ArrayDeleter<VkSurfaceFormatKHR> surfaceFormats(new(std::nothrow) VkSurfaceFormatKHR[*count]);
+	if (!surfaceFormats.IsSet())
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+	VkResult res = surface->GetFormats(physDev, count, surfaceFormats.Get());
+	for (uint32_t i = 0; i < *count; i++)
+		formats[i].surfaceFormat = surfaceFormats[i];
+	return res;
 }
 
 VkResult Layer_GetPhysicalDeviceSurfaceFormatsKHR(VkPhysicalDevice physDev, VkSurfaceKHR surface, uint32_t *count, VkSurfaceFormatKHR *formats)
@@ -791,10 +2240,10 @@ VkResult Layer_CreateSwapchainKHR(VkDevice device,
         const VkAllocationCallbacks *allocator, VkSwapchainKHR *swapchain)
 {
 	(void)allocator;
-	auto wineSwapchain = new(std::nothrow) VKLayerSwapchain();
-	if (wineSwapchain == NULL) return VK_ERROR_OUT_OF_HOST_MEMORY;
+	ObjectDeleter<VKLayerSwapchain> wineSwapchain(new(std::nothrow) VKLayerSwapchain());
+	if (!wineSwapchain.IsSet()) return VK_ERROR_OUT_OF_HOST_MEMORY;
 	VkCheckRet(wineSwapchain->Init(LayerDevice::FromHandle(device), *createInfo));
-	*swapchain = wineSwapchain->ToHandle();
+	*swapchain = wineSwapchain.Detach()->ToHandle();
 	return VK_SUCCESS;
 }
 
@@ -825,12 +2274,136 @@ VkResult Layer_AcquireNextImageKHR(
 	return VKLayerSwapchain::FromHandle(swapchain)->AcquireNextImage(&info, pImageIndex);
 }
 
+// The presents of a call are submitted at once, with one submission and
+// fence per queue they run on. Only the first submission waits on the
+// application semaphores, so the readbacks do not queue up behind the
+// rendering of the next frame on the application's queue. Submissions on the
+// other queues wait for the first one.
+static void submitPresents(LayerDevice *device, VkQueue presentQueue, const VkPresentInfoKHR *presentInfo, PresentSubmit *submits, uint32_t submitCnt)
+{
+	// The layer's transfer and blit queues and the presenting queue.
+	static constexpr int32 kMaxBatches = 3;
+	struct Batch {
+		VkQueue queue = VK_NULL_HANDLE;
+		std::vector<VkCommandBuffer> cmds;
+		std::vector<VkSemaphore> signalSems;
+		VkSemaphore chainSem = VK_NULL_HANDLE;
+		bool fenced = false;
+	} batches[kMaxBatches];
+	int32 batchCnt = 0;
+	for (uint32_t i = 0; i < submitCnt; i++) {
+		PresentSubmit &submit = submits[i];
+		if (!submit.prepared)
+			continue;
+		int32 batchIdx = 0;
+		while (batchIdx < batchCnt && batches[batchIdx].queue != submit.queue)
+			batchIdx++;
+		if (batchIdx == batchCnt) {
+			assert(batchCnt < kMaxBatches);
+			batches[batchCnt].queue = submit.queue;
+			batches[batchCnt].chainSem = submit.chainSem;
+			batchCnt++;
+		}
+		Batch &batch = batches[batchIdx];
+		if (submit.cmd != VK_NULL_HANDLE)
+			batch.cmds.push_back(submit.cmd);
+		batch.signalSems.push_back(submit.releaseSem);
+		batch.fenced = batch.fenced || submit.fenced;
+	}
+	for (int32 batchIdx = 1; batchIdx < batchCnt; batchIdx++)
+		batches[0].signalSems.push_back(batches[batchIdx].chainSem);
+
+	std::vector<VkPipelineStageFlags> waitStages(presentInfo->waitSemaphoreCount, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+	VkPipelineStageFlags chainStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+	// The application semaphores are consumed even if no present is left.
+	if (batchCnt == 0) {
+		if (presentInfo->waitSemaphoreCount > 0) {
+			VkSubmitInfo submitInfo{
+				.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+				.waitSemaphoreCount = presentInfo->waitSemaphoreCount,
+				.pWaitSemaphores = presentInfo->pWaitSemaphores,
+				.pWaitDstStageMask = waitStages.data()
+			};
+			device->Submit(presentQueue, 1, &submitInfo, VK_NULL_HANDLE);
+		}
+		return;
+	}
+
+	VkResult firstRes = VK_SUCCESS;
+	for (int32 batchIdx = 0; batchIdx < batchCnt; batchIdx++) {
+		Batch &batch = batches[batchIdx];
+		VkSubmitInfo submitInfo{
+			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			.waitSemaphoreCount = presentInfo->waitSemaphoreCount,
+			.pWaitSemaphores = presentInfo->pWaitSemaphores,
+			.pWaitDstStageMask = waitStages.data(),
+			.commandBufferCount = (uint32_t)batch.cmds.size(),
+			.pCommandBuffers = batch.cmds.data(),
+			.signalSemaphoreCount = (uint32_t)batch.signalSems.size(),
+			.pSignalSemaphores = batch.signalSems.data()
+		};
+		VkResult res = VK_SUCCESS;
+		if (batchIdx > 0) {
+			submitInfo.waitSemaphoreCount = 1;
+			submitInfo.pWaitSemaphores = &batch.chainSem;
+			submitInfo.pWaitDstStageMask = &chainStage;
+			res = firstRes;
+		}
+
+		SharedFence *fence = NULL;
+		if (res == VK_SUCCESS && batch.fenced)
+			res = SharedFence::Create(device, fence);
+		if (res == VK_SUCCESS)
+			res = device->Submit(batch.queue, 1, &submitInfo, fence != NULL ? fence->ToHandle() : VK_NULL_HANDLE);
+		if (batchIdx == 0) {
+			firstRes = res;
+		} else if (res != VK_SUCCESS && firstRes == VK_SUCCESS) {
+			// Nothing waits on the signaled chain semaphore now, it must be
+			// unsignaled before the next present of the image signals it.
+			VkSubmitInfo drainInfo{
+				.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+				.waitSemaphoreCount = 1,
+				.pWaitSemaphores = &batch.chainSem,
+				.pWaitDstStageMask = &chainStage
+			};
+			device->Submit(batches[0].queue, 1, &drainInfo, VK_NULL_HANDLE);
+		}
+
+		for (uint32_t i = 0; i < submitCnt; i++) {
+			PresentSubmit &submit = submits[i];
+			if (!submit.prepared || submit.queue != batch.queue)
+				continue;
+			submit.result = res;
+			if (res == VK_SUCCESS && submit.fenced) {
+				fence->AcquireReference();
+				submit.fence = fence;
+			}
+		}
+		if (fence != NULL)
+			fence->ReleaseReference();
+	}
+}
+
 VkResult Layer_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
 {
+	uint32_t swapchainCnt = pPresentInfo->swapchainCount;
+	if (swapchainCnt == 0)
+		return VK_SUCCESS;
+	ArrayDeleter<PresentSubmit> submits(new(std::nothrow) PresentSubmit[swapchainCnt]);
+	if (!submits.IsSet())
+		return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+	for (uint32_t i = 0; i < swapchainCnt; ++i) {
+		auto *sc = VKLayerSwapchain::FromHandle(pPresentInfo->pSwapchains[i]);
+		submits[i].result = sc->PreparePresent(queue, pPresentInfo, i, submits[i]);
+	}
+	submitPresents(VKLayerSwapchain::FromHandle(pPresentInfo->pSwapchains[0])->GetDevice(), queue, pPresentInfo, submits.Get(), swapchainCnt);
+
 	VkResult ret = VK_SUCCESS;
-	for (uint32_t i = 0; i < pPresentInfo->swapchainCount; ++i) {
+	for (uint32_t i = 0; i < swapchainCnt; ++i) {
 		auto *sc = VKLayerSwapchain::FromHandle(pPresentInfo->pSwapchains[i]);
-		VkResult res = sc->QueuePresent(queue, pPresentInfo, i);
+		VkResult res = submits[i].prepared ? sc->FinishPresent(pPresentInfo, i, submits[i]) : submits[i].result;
 
 		if (pPresentInfo->pResults != nullptr)
 			pPresentInfo->pResults[i] = res;
@@ -841,3 +2414,15 @@ VkResult Layer_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentIn
 
 	return ret;
 }
+
+VkResult Layer_WaitForPresentKHR(VkDevice device, VkSwapchainKHR swapchain, uint64_t presentId, uint64_t timeout)
+{
+	(void)device;
+	return VKLayerSwapchain::FromHandle(swapchain)->WaitForPresent(presentId, timeout);
+}
+
+VkResult Layer_ReleaseSwapchainImagesEXT(VkDevice device, const VkReleaseSwapchainImagesInfoEXT *pReleaseInfo)
+{
+	(void)device;
+	return VKLayerSwapchain::FromHandle(pReleaseInfo->swapchain)->ReleaseImages(pReleaseInfo);
+}